@@ -0,0 +1,52 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "arena.h"
+
+// A memory area adopted by the arena: free space goes from top to end
+typedef struct {
+    uint8_t *start;
+    uint8_t *top;
+    uint8_t *end;
+    uint8_t *last;  // Latest allocation, the only one that can be given back
+} ArenaArea;
+
+static ArenaArea arena_areas[ARENA_AREAS_MAX];
+static uint8_t arena_areas_count;
+
+void arena_add(void *start, uint16_t size)
+{
+    if (arena_areas_count == ARENA_AREAS_MAX) return;
+    ArenaArea *area = &arena_areas[arena_areas_count++];
+    area->start = (uint8_t *)start;
+    area->top = area->start;
+    area->end = area->start + size;
+    area->last = NULL;
+}
+
+void *arena_alloc(uint16_t size)
+{
+    for(uint8_t a = 0; a < arena_areas_count; a++) {
+        ArenaArea *area = &arena_areas[a];
+        if (size && area->end - area->top >= size) {
+            area->last = area->top;
+            area->top += size;
+            return area->last;
+        }
+    }
+    return NULL;
+}
+
+bool arena_free(void *ptr)
+{
+    for(uint8_t a = 0; a < arena_areas_count; a++) {
+        ArenaArea *area = &arena_areas[a];
+        if ((uint8_t *)ptr >= area->start && (uint8_t *)ptr < area->end) {
+            if ((uint8_t *)ptr == area->last) {
+                area->top = area->last;
+                area->last = NULL;
+            }
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,37 @@
+#ifndef PB_ARENA_H
+#define PB_ARENA_H
+
+#include <stdint.h>
+
+/*
+ * Arena allocator for memory areas that are only needed at startup
+ *
+ * Once their content has been copied where it belongs, areas like the embedded charset
+ * and background screen are handed over to the arena, which serves buffers from them
+ * bumping a pointer. There's no general free: only the latest allocation of an area
+ * can be given back, which is enough for buffers reallocated when they have to grow.
+ * When no area has room callers are expected to fall back to malloc().
+ */
+
+// Memory areas the arena can adopt
+#define ARENA_AREAS_MAX 4
+
+/*
+ * Adds a memory area to the arena, its content is going to be overwritten
+ */
+void arena_add(void *start, uint16_t size);
+
+/*
+ * Returns size bytes taken from the first area with enough room, or NULL if none has
+ */
+void *arena_alloc(uint16_t size);
+
+/*
+ * Gives memory back if ptr is the latest allocation of its area
+ * Returns false if ptr doesn't come from the arena (so it has to be freed some other way)
+ */
+bool arena_free(void *ptr);
+
+#pragma compile("arena.c")
+
+#endif
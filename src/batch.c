@@ -1,19 +1,27 @@
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <c64/kernalio.h>
 #include "neuralnet.h"
 #include "batch.h"
+#include "fastload.h"
+#include "arena.h"
+#ifdef BENCHMARK
+#include "benchmark.h"
+#endif
 
 /*
  * This array is used to determine batches loading order
  * We could use a feistel network to obtain a random sequence instead,
  * but given the very limited number of items an array with a shuffling
  * function is still a better solution in terms of space and simplicity.
- * We're going to store here all batches indexes multiplied for the epochs,
- * then we'll simply obtain the next index and load the corresponding
- * batch from disk.
+ * We're going to store here all training batches indexes, shuffled again
+ * at the beginning of every epoch, then we'll simply obtain the next index
+ * and load the corresponding batch from disk.
  */
-uint8_t batch_indexes[EPOCHS * BATCHES_COUNT];
+uint8_t batch_indexes[DATASET_BATCH_COUNT_MAX - 1];
 
 /*
  * Shuffles an array of bytes using Sattolo's algorithm
@@ -30,49 +38,290 @@ void shuffle_array(uint8_t arr[], int size)
     }
 }
 
+bool load_dataset(uint8_t device, Training *training)
+{
+    Dataset *dataset = &training->dataset;
+    uint8_t header[8];
+
+    dataset->record_length = BATCH_ROW_LENGTH;
+    dataset->records_per_batch = DATASET_DEFAULT_RECORDS_PER_BATCH;
+    dataset->batch_count = DATASET_DEFAULT_BATCH_COUNT;
+    dataset->record_count = DATASET_DEFAULT_RECORD_COUNT;
+    dataset->encoding = DATASET_DEFAULT_ENCODING;
+
+    // Header: version, record length, records per batch (16 bit), batch count, total records (16 bit), encoding
+    // Version 1 headers have no encoding byte, their batches are always raw
+    // Without any header the original raw dataset is assumed, as found on older disks
+	krnio_setnam(DATASET_FILENAME ",U,R");
+	if (krnio_open(2, (char)device, 2)) {
+        int length = krnio_read(2, (char *)header, sizeof(header));
+        if ((header[0] == 1 && length >= 7) || (header[0] == DATASET_VERSION && length == sizeof(header))) {
+            dataset->record_length = header[1];
+            dataset->records_per_batch = header[2] | (header[3] << 8);
+            dataset->batch_count = header[4];
+            dataset->record_count = header[5] | (header[6] << 8);
+            dataset->encoding = header[0] == DATASET_VERSION ? (DatasetEncoding)header[7] : DE_RAW;
+        }
+		krnio_close(2);
+	}
+    if (dataset->encoding > DE_RUN_LENGTH) return false;
+    if (dataset->record_length != BATCH_ROW_LENGTH || dataset->batch_count < 2 || !dataset->records_per_batch || dataset->records_per_batch > DATASET_RECORDS_PER_BATCH_MAX) return false;
+
+    // Fine-tuning needs room for its own batch too
+    uint16_t capacity = dataset->records_per_batch > FINETUNE_ROWS ? dataset->records_per_batch : FINETUNE_ROWS;
+    if (capacity > training->batch_capacity) {
+        // Reclaimed startup memory is used first, the heap only when the batch doesn't fit there
+        if (!arena_free(training->batch)) free(training->batch);
+        training->batch = (uint8_t (*)[BATCH_ROW_LENGTH])arena_alloc(capacity * BATCH_ROW_LENGTH);
+        if (!training->batch) training->batch = (uint8_t (*)[BATCH_ROW_LENGTH])malloc(capacity * BATCH_ROW_LENGTH);
+        training->batch_capacity = training->batch ? capacity : 0;
+    }
+    return training->batch != NULL;
+}
+
 /*
  * Initializes training data structure
  */
 void init_training(Training *training)
 {
-    // We will fill the array with indexes, repeated EPOCHS times,
-    // and shuffle them in their epoch section.
-    // Every epoch should process a batch only once, so the sequence obtained
-    // at the end should reflect this constraint.
-    for(uint8_t e = 0; e < EPOCHS; e++) {
-        for(uint8_t i = 0; i < BATCHES_COUNT; i++) {
-            batch_indexes[i + (e * BATCHES_COUNT)] = i;
-        }
-
-        // Passing the first element address and the number of elements to shuffle
-        shuffle_array(&batch_indexes[e * BATCHES_COUNT], BATCHES_COUNT);
+    // We will fill the array with training batches indexes and shuffle them,
+    // every epoch should process a batch only once and in a new order.
+    // The validation batch is left out, being the last one it's enough to stop before it.
+    uint8_t training_batches = training->dataset.batch_count - 1;
+    for(uint8_t i = 0; i < training_batches; i++) {
+        batch_indexes[i] = i;
     }
-    training->batch_index = (EPOCHS * BATCHES_COUNT) - 1;
+    shuffle_array(batch_indexes, training_batches);
+    training->epoch = 0;
+    training->batch_index = 0;
+    training->loaded_records = 0;
+    training->record_index = 0;
     training->processed = 0;
     training->correct = 0;
     training->stopped = false;
+    training->learning_rate = LEARNING_RATE;
+    training->best_accuracy = 0;
+    training->records_since_check = 0;
+    training->phase = TP_IDLE;
+    training->validation_correct = 0;
+    training->scored_batches = 0;
 }
 
-void load_training_batch(uint8_t device, Training *training)
+uint8_t validation_batch(Training *training)
 {
-    char batch_filename[13];
-    sprintf(batch_filename, "NEURAL%02X,U,R", batch_indexes[training->batch_index]);
-    training->loaded_records = 0;
-	krnio_setnam(batch_filename);
-	if (krnio_open(2, (char)device, 2)) {
-        for(uint8_t row = 0; row < BATCH_ROW_COUNT_MAX; row++) {
-            int ch;
-            for(uint8_t row_item = 0; row_item < BATCH_ROW_LENGTH; row_item++) {
-                ch = krnio_getch(2);
-                if (ch & 0x100) break;
-                training->batch[row][row_item] = ch;
-            }
-            if (ch & 0x100) {
-                training->loaded_records = row + 1;
-                break;
+    return training->dataset.batch_count - 1;
+}
+
+bool load_training_batch(uint8_t device, Training *training)
+{
+    uint8_t training_batches = training->dataset.batch_count - 1;
+    if (training->batch_index == training_batches) {
+        // Epoch completed, start a new one in a different order
+        training->batch_index = 0;
+        if (++training->epoch == EPOCHS) return false;
+        shuffle_array(batch_indexes, training_batches);
+    }
+    load_batch(device, training, batch_indexes[training->batch_index++]);
+    return true;
+}
+
+/*
+ * Reads a byte from the file being loaded, either through the fast loader or the KERNAL
+ */
+static int read_byte(bool fast)
+{
+    return fast ? fastload_getch() : krnio_getch(2);
+}
+
+/*
+ * Reads raw 33 byte records into consecutive batch rows, returns the number of complete records read
+ */
+static uint16_t read_raw_records(bool fast, uint8_t (*rows)[BATCH_ROW_LENGTH], uint16_t max_rows, bool wrap)
+{
+    uint16_t records = 0;
+    int ch = 0;
+    while(!(ch & 0x100) && (wrap || records < max_rows)) {
+        uint8_t *row = rows[records % max_rows];
+        uint8_t row_item = 0;
+        do {
+            // The last byte of the file comes with the EOF flag set, but it's still valid
+            ch = read_byte(fast);
+            if (ch < 0) break;
+            row[row_item++] = ch;
+        } while(!(ch & 0x100) && row_item < BATCH_ROW_LENGTH);
+        if (row_item == BATCH_ROW_LENGTH) records++;
+    }
+    return records;
+}
+
+// Run length decoder state: last byte read (with the EOF flag) and whether its low nibble is still to be used
+static int packed_byte;
+static bool packed_low_nibble;
+
+/*
+ * Reads the next nibble of a run length coded file, high nibble first, returns -1 at the end of the file
+ */
+static int read_nibble(bool fast)
+{
+    if (packed_low_nibble) {
+        packed_low_nibble = false;
+        return packed_byte & 0x0f;
+    }
+    if (packed_byte & 0x100) return -1;
+    packed_byte = read_byte(fast);
+    if (packed_byte < 0) return -1;
+    packed_low_nibble = true;
+    return (packed_byte >> 4) & 0x0f;
+}
+
+/*
+ * Expands run length coded records straight into consecutive batch rows, returns the number of complete records read
+ * Every record is a sequence of nibbles, starting on a byte boundary: the label, then the lengths of
+ * alternating runs of unlit and lit pixels (the first one may be empty) covering all the 256 pixels.
+ * Lengths of 15 pixels or more are split, nibble 15 meaning "15 more pixels, the run goes on"
+ */
+static uint16_t read_packed_records(bool fast, uint8_t (*rows)[BATCH_ROW_LENGTH], uint16_t max_rows)
+{
+    uint16_t records = 0;
+    packed_byte = 0;
+    while(!(packed_byte & 0x100) && records < max_rows) {
+        uint8_t *row = rows[records];
+        uint16_t pixel = 0;
+        bool lit = false;
+        int nibble;
+
+        // A record never starts in the middle of a byte, the padding nibble is dropped
+        packed_low_nibble = false;
+        nibble = read_nibble(fast);
+        if (nibble < 0) break;
+        row[BATCH_ROW_LENGTH - 1] = nibble;
+        memset(row, 0, BATCH_ROW_LENGTH - 1);
+        while(pixel < INPUT_LAYER_SIZE) {
+            uint16_t run = 0;
+            do {
+                nibble = read_nibble(fast);
+                if (nibble < 0) return records;
+                run += nibble;
+            } while(nibble == 15);
+            // Runs going past the last pixel mean the file is damaged
+            if (run > INPUT_LAYER_SIZE - pixel) return records;
+            if (lit) {
+                for(uint16_t end = pixel + run; pixel < end; pixel++) {
+                    row[pixel >> 3] |= 0x80 >> (pixel & 7);
+                }
+            } else {
+                pixel += run;
             }
+            lit = !lit;
         }
-		krnio_close(2);
+        records++;
+    }
+    return records;
+}
+
+/*
+ * Reads records from a file into consecutive batch rows, returns the number of complete records read
+ * Run length coded files are expanded while they're read, raw ones are copied as they are
+ * When wrap is set (raw files only) and the file holds more than max_rows records the rows are reused as a ring,
+ * so only the latest max_rows records are kept
+ * Files are fast loaded from 1541 drives, any other device goes through the KERNAL
+ */
+uint16_t read_records(uint8_t device, const char *filename, uint8_t (*rows)[BATCH_ROW_LENGTH], uint16_t max_rows, bool wrap, DatasetEncoding encoding)
+{
+    uint16_t records = 0;
+    bool fast = fastload_open(device, filename);
+    if (!fast) krnio_setnam(filename);
+	if (fast || krnio_open(2, (char)device, 2)) {
+        if (encoding == DE_RUN_LENGTH) records = read_packed_records(fast, rows, max_rows);
+        else records = read_raw_records(fast, rows, max_rows, wrap);
+        if (fast) fastload_close();
+		else krnio_close(2);
 	}
+    return records < max_rows ? records : max_rows;
+}
+
+void load_batch(uint8_t device, Training *training, uint8_t index)
+{
+    char batch_filename[13];
+#ifdef BENCHMARK
+    uint32_t start = jiffies();
+#endif
+    sprintf(batch_filename, "NEURAL%02X,U,R", index);
+    training->loaded_records = read_records(device, batch_filename, training->batch, training->batch_capacity, false, training->dataset.encoding);
     training->record_index = 0;
+#ifdef BENCHMARK
+    benchmark_load_jiffies += jiffies() - start;
+#endif
+}
+
+uint8_t load_finetune_batch(uint8_t device, Training *training)
+{
+    char batch_filename[13];
+    uint8_t replayed = read_records(device, REPLAY_FILENAME ",U,R", training->batch, REPLAY_ROWS_MAX, true, DE_RAW);
+    training->loaded_records = replayed;
+    if (replayed) {
+        // Some dataset records keep the network from drifting too far towards the user's handwriting
+        sprintf(batch_filename, "NEURAL%02X,U,R", rand() % validation_batch(training));
+        training->loaded_records += read_records(device, batch_filename, &training->batch[replayed], REPLAY_MIX_ROWS, false, training->dataset.encoding);
+    }
+    training->record_index = 0;
+    return replayed;
+}
+
+bool open_for_append(uint8_t device, const char *filename)
+{
+    char name[20];
+    char status[2] = {0, 0};
+
+    // Command channel has to stay open while the file is in use: closing it closes every file on the drive
+    krnio_setnam("");
+    if (!krnio_open(15, (char)device, 15)) return false;
+    sprintf(name, "%s,U,A", filename);
+    krnio_setnam(name);
+    if (krnio_open(2, (char)device, 2)) {
+        krnio_read(15, status, 2);
+        if (status[0] == '6' && status[1] == '2') {
+            // File not found, nothing appended yet: create it
+            krnio_close(2);
+            sprintf(name, "%s,U,W", filename);
+            krnio_setnam(name);
+            krnio_open(2, (char)device, 2);
+        }
+        return true;
+    }
+    krnio_close(15);
+    return false;
+}
+
+void close_appended(void)
+{
+    krnio_close(2);
+    krnio_close(15);
+}
+
+bool append_replay_record(uint8_t device, input_t input, uint8_t label)
+{
+    uint8_t record[BATCH_ROW_LENGTH];
+    bool result = false;
+    memcpy(record, input, BATCH_ROW_LENGTH - 1);
+    record[BATCH_ROW_LENGTH - 1] = label;
+
+    if (open_for_append(device, REPLAY_FILENAME)) {
+        result = krnio_write(2, (char *)record, BATCH_ROW_LENGTH) == BATCH_ROW_LENGTH;
+        close_appended();
+    }
+    return result;
+}
+
+ScheduleState update_schedule(Training *training, uint8_t accuracy)
+{
+    training->records_since_check = 0;
+    if (accuracy >= TARGET_ACCURACY) return SS_TARGET;
+    if (accuracy > training->best_accuracy) {
+        training->best_accuracy = accuracy;
+        return SS_RUNNING;
+    }
+    // No progress since last check, take smaller steps from now on
+    training->learning_rate *= LEARNING_RATE_DECAY;
+    return training->learning_rate < LEARNING_RATE_MIN ? SS_PLATEAU : SS_RUNNING;
 }
@@ -4,29 +4,147 @@
 #include <stdint.h>
 #include "neuralnet.h"
 
-#define BATCHES_COUNT 16
+// Dataset geometry is described by this file, written by tools/rechunk.py along with the batches
+#define DATASET_FILENAME "DATASET"
+#define DATASET_VERSION 2
+// Geometry of the original dataset, assumed when the header file is missing
+#define DATASET_DEFAULT_RECORDS_PER_BATCH 100
+#define DATASET_DEFAULT_BATCH_COUNT 16
+#define DATASET_DEFAULT_RECORD_COUNT 1593
+// ...stored the way disks made before the header existed are, only a header can declare run length coding
+#define DATASET_DEFAULT_ENCODING DE_RAW
+// Batch indexes are bytes and a batch must be left for validation
+#define DATASET_BATCH_COUNT_MAX 255
+// Largest batch the reclaimed startup memory holds (0xb700-0xc780, see main()), there's no heap reserved for more
+#define DATASET_RECORDS_PER_BATCH_MAX 128
+
+// User drawn digits and their labels are appended to this file, using the same record format of the batches
+#define REPLAY_FILENAME "REPLAY"
+// A fine-tuning batch holds up to this many replayed records (the latest ones)...
+#define REPLAY_ROWS_MAX 80
+// ...followed by a few dataset records
+#define REPLAY_MIX_ROWS 20
+#define FINETUNE_ROWS (REPLAY_ROWS_MAX + REPLAY_MIX_ROWS)
+
+// How records are stored in the batch files
+enum DatasetEncoding {
+    DE_RAW,         // 33 byte records, as they are kept in memory
+    DE_RUN_LENGTH   // Run length coded pixels, expanded while loading (see tools/rechunk.py)
+};
+
+// What a training session is doing, training is split in steps so it can be interleaved with other activities
+enum TrainingPhase {
+    TP_IDLE,            // No training session in progress
+    TP_LOADING,         // Next training batch has to be loaded
+    TP_TRAINING,        // Training on the current batch
+    TP_LOADING_CHECK,   // Validation batch has to be loaded
+    TP_VALIDATING,      // Checking accuracy on the validation batch
+    TP_LOADING_SCORES,  // Training is over, next batch to score hidden neurons on has to be loaded
+    TP_SCORING          // Collecting hidden activations on the current batch, the weakest neurons are pruned at the end
+};
+
+// Training schedule outcome, see update_schedule()
+enum ScheduleState {
+    SS_RUNNING,     // Keep on training
+    SS_TARGET,      // Target accuracy reached
+    SS_PLATEAU      // Accuracy doesn't improve anymore
+};
+
+/*
+ * Dataset geometry, as read from the header file
+ * The last batch is never used for training, it's reserved to measure validation accuracy
+ */
+typedef struct {
+    uint8_t record_length;      // Bytes per record, must match BATCH_ROW_LENGTH
+    uint16_t records_per_batch; // Records in every batch file (the last one may hold less)
+    uint8_t batch_count;        // Number of batch files
+    uint16_t record_count;      // Total records
+    DatasetEncoding encoding;   // How records are stored in the batch files
+} Dataset;
 
 /*
  * Contains training process data
  */
 typedef struct {
-    batch_t batch;          // Current batch input data
-    int8_t batch_index;    // Current batch index, loop is in reverse, so when index is -1 we know that the loop has ended
-    uint8_t loaded_records; // How many records have been loaded from disk
+    Dataset dataset;        // Geometry of the dataset on disk
+    uint8_t (*batch)[BATCH_ROW_LENGTH]; // Current batch input data, allocated on the heap
+    uint16_t batch_capacity;    // How many records fit into the batch buffer
+    uint8_t epoch;          // Current epoch
+    uint8_t batch_index;    // Position of current batch in the shuffled epoch order
+    uint16_t loaded_records; // How many records have been loaded from disk
     uint16_t correct;       // Total correct guesses
     uint16_t processed;     // How many record have been processed so far
-    uint8_t record_index;   // Current record index
+    uint16_t record_index;  // Current record index
     volatile bool stopped; // Non-zero if user pressed RUN/STOP during training
+    float learning_rate;    // Current learning rate, lowered by the schedule on every stall
+    uint8_t best_accuracy;  // Best validation accuracy so far, in percent
+    uint16_t records_since_check; // Training records processed since last validation check
+    TrainingPhase phase;    // Progress of the training session, any other use of the batch ends it
+    uint16_t validation_correct; // Correct guesses on the validation batch so far
+    uint8_t scored_batches; // Training batches hidden neurons have been scored on
+    HiddenStats hidden_stats; // Hidden activations collected over every training batch, for pruning
 
 }  Training;
 
+/*
+ * Reads the dataset geometry from disk and makes room for a whole batch in memory
+ * Returns false if the dataset can't be used: records of the wrong size or a batch too large for the available memory
+ */
+bool load_dataset(uint8_t device, Training *training);
+
+/*
+ * Initializes training data structure, the dataset must have been loaded
+ * Any training session in progress is over, its batch is going to be replaced
+ */
 void init_training(Training *training);
 
 /*
- * Loads a batch of records from disk, returns the number of loaded items
+ * Shuffles an array of bytes
+ */
+void shuffle_array(uint8_t arr[], int size);
+
+/*
+ * Index of the batch reserved for validation
+ */
+uint8_t validation_batch(Training *training);
+
+/*
+ * Loads a batch of records from disk, loaded_records contains the number of loaded items
+ */
+void load_batch(uint8_t device, Training *training, uint8_t index);
+
+/*
+ * Moves to the next batch in training order and loads it, returns false once all epochs are done
+ */
+bool load_training_batch(uint8_t device, Training *training);
+
+/*
+ * Loads the replay buffer mixed with a few records of a random dataset batch, returns the number of replayed records
+ */
+uint8_t load_finetune_batch(uint8_t device, Training *training);
+
+/*
+ * Opens a file for appending on channel 2, creating it if needed, the command channel (15) is kept open as well
+ * Returns false if the file can't be opened, when it succeeds close_appended() must be called once done writing
+ */
+bool open_for_append(uint8_t device, const char *filename);
+
+/*
+ * Closes the file opened by open_for_append()
+ */
+void close_appended(void);
+
+/*
+ * Appends a user drawn digit to the replay buffer file
+ */
+bool append_replay_record(uint8_t device, input_t input, uint8_t label);
+
+/*
+ * Feeds a validation accuracy measurement to the training schedule
+ * The learning rate is decayed when accuracy doesn't improve, the result tells whether training should go on
  */
-void load_training_batch(uint8_t device, Training *training);
+ScheduleState update_schedule(Training *training, uint8_t accuracy);
 
 #pragma compile("batch.c")
 
-#endif
\ No newline at end of file
+#endif
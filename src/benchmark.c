@@ -0,0 +1,18 @@
+#include <stdint.h>
+#include "benchmark.h"
+
+// KERNAL jiffy clock, three bytes, most significant first
+#define JIFFY_CLOCK ((volatile uint8_t *)0x00a0)
+
+uint32_t benchmark_load_jiffies;
+
+uint32_t jiffies(void)
+{
+    uint32_t value, check;
+    // The clock is updated by an interrupt, read it until two readings match
+    do {
+        value = ((uint32_t)JIFFY_CLOCK[0] << 16) | ((uint16_t)JIFFY_CLOCK[1] << 8) | JIFFY_CLOCK[2];
+        check = ((uint32_t)JIFFY_CLOCK[0] << 16) | ((uint16_t)JIFFY_CLOCK[1] << 8) | JIFFY_CLOCK[2];
+    } while (value != check);
+    return value;
+}
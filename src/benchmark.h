@@ -0,0 +1,26 @@
+#ifndef PB_BENCHMARK_H
+#define PB_BENCHMARK_H
+
+#include <stdint.h>
+
+/*
+ * Headless benchmark support, only built when BENCHMARK is defined (see tools/benchmark.py)
+ */
+
+// Phase timings are saved into this sequential file on the benchmark disk
+#define BENCHMARK_FILENAME "RESULTS"
+
+// Writing here makes VICE quit when started with -debugcart, it's harmless on real hardware
+#define DEBUG_CART_EXIT ((volatile char *)0xd7ff)
+
+// Jiffies spent loading batches from disk since last reset
+extern uint32_t benchmark_load_jiffies;
+
+/*
+ * Reads KERNAL jiffy clock (1/60 s ticks, updated by the system interrupt)
+ */
+uint32_t jiffies(void);
+
+#pragma compile("benchmark.c")
+
+#endif
@@ -0,0 +1,394 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <c64/cia.h>
+#include <c64/kernalio.h>
+#include "fastload.h"
+
+// Drive RAM where the transfer routine is placed: buffers 2 and 3, not used by DOS while no file is open
+#define DRIVE_CODE_ADDRESS  0x0500
+// File name to look for, 16 bytes padded with shifted spaces as in directory entries
+#define DRIVE_NAME_ADDRESS  0x0628
+#define DRIVE_NAME_LENGTH   16
+// Bytes sent with a single M-W command, 6 command bytes plus the data must fit the 42 byte DOS command buffer
+#define MEMORY_WRITE_CHUNK  32
+// Bytes read back at the start of every drive page the routine takes, to tell whether it's still there
+#define RESIDENT_CHECK      8
+
+// Block status, first byte sent by the drive for every block
+#define BLOCK_MORE      0x00    // More blocks follow
+#define BLOCK_LAST      0x01    // Last block of the file
+#define BLOCK_ERROR     0xff    // File not found or read error, no data follows
+
+// Delays between an ATN toggle and the read of the bit pair it requested, in 5 cycles loop iterations.
+// Before the first pair of a byte the drive has to fetch the byte and split it in nibbles (about 70 cycles),
+// the other pairs are ready in less than 20 cycles.
+#define DELAY_FIRST_PAIR    20
+#define DELAY_PAIR          6
+
+#define BUS_CLK_IN  0x40
+#define BUS_ATN_OUT 0x08
+
+/*
+ * Drive side routine, assembled for 0x0500
+ * PORT = 0x1800 (VIA1 port B), BUF0 = 0x0300 (buffer 0), job code and track/sector for buffer 0 at 0x00, 0x06/0x07
+ * Lines meaning while the C64 waits: CLK low = busy, all released = ready
+ * Every block is sent as: status byte, length byte, length data bytes, then the C64 acknowledges with an ATN pulse
+ */
+static const uint8_t drive_code[] = {
+    0x78,              // 0500 start:   sei
+    0xa9, 0x08,        // 0501          lda #$08               ; CLK low: busy
+    0x8d, 0x00, 0x18,  // 0503          sta PORT
+    0xa9, 0x12,        // 0506          lda #18                ; directory starts at 18/1
+    0xa2, 0x01,        // 0508          ldx #1
+    0x20, 0x9f, 0x05,  // 050a dirsec:  jsr readsec
+    0xb0, 0x79,        // 050d          bcs error
+    0xa0, 0x02,        // 050f          ldy #2
+    0x8c, 0x25, 0x06,  // 0511 entry:   sty ent
+    0xb9, 0x00, 0x03,  // 0514          lda BUF0,y             ; file type, 0 for empty entries
+    0xf0, 0x5e,        // 0517          beq skip
+    0xa2, 0x00,        // 0519          ldx #0
+    0xb9, 0x03, 0x03,  // 051b cmpn:    lda BUF0+3,y
+    0xdd, 0x28, 0x06,  // 051e          cmp name,x
+    0xd0, 0x54,        // 0521          bne skip
+    0xc8,              // 0523          iny
+    0xe8,              // 0524          inx
+    0xe0, 0x10,        // 0525          cpx #16
+    0xd0, 0xf2,        // 0527          bne cmpn
+    0xac, 0x25, 0x06,  // 0529          ldy ent                ; found, fetch first track/sector
+    0xbe, 0x02, 0x03,  // 052c          ldx BUF0+2,y
+    0xb9, 0x01, 0x03,  // 052f          lda BUF0+1,y
+    0x20, 0x9f, 0x05,  // 0532 filesec: jsr readsec
+    0xb0, 0x51,        // 0535          bcs error
+    0xa2, 0xfe,        // 0537          ldx #254               ; full block, more to come
+    0xa9, 0x00,        // 0539          lda #$00
+    0xac, 0x00, 0x03,  // 053b          ldy BUF0
+    0xd0, 0x06,        // 053e          bne full
+    0xae, 0x01, 0x03,  // 0540          ldx BUF0+1             ; last block, X = last byte index - 1
+    0xca,              // 0543          dex
+    0xa9, 0x01,        // 0544          lda #$01
+    0x8e, 0x26, 0x06,  // 0546 full:    stx count
+    0xa0, 0x00,        // 0549          ldy #$00               ; ready
+    0x8c, 0x00, 0x18,  // 054b          sty PORT
+    0x20, 0xc8, 0x05,  // 054e          jsr send               ; block status
+    0xad, 0x26, 0x06,  // 0551          lda count
+    0x20, 0xc8, 0x05,  // 0554          jsr send               ; block length
+    0xa0, 0x00,        // 0557          ldy #0
+    0xcc, 0x26, 0x06,  // 0559          cpy count
+    0xf0, 0x0c,        // 055c          beq blkdone
+    0xb9, 0x02, 0x03,  // 055e data:    lda BUF0+2,y
+    0x20, 0xc8, 0x05,  // 0561          jsr send
+    0xc8,              // 0564          iny
+    0xcc, 0x26, 0x06,  // 0565          cpy count
+    0xd0, 0xf4,        // 0568          bne data
+    0x20, 0xb3, 0x05,  // 056a blkdone: jsr ack
+    0xae, 0x01, 0x03,  // 056d          ldx BUF0+1
+    0xad, 0x00, 0x03,  // 0570          lda BUF0
+    0xd0, 0xbd,        // 0573          bne filesec
+    0xf0, 0x1e,        // 0575          beq exit
+    0xad, 0x25, 0x06,  // 0577 skip:    lda ent                ; next directory entry
+    0x18,              // 057a          clc
+    0x69, 0x20,        // 057b          adc #32
+    0xa8,              // 057d          tay
+    0x90, 0x91,        // 057e          bcc entry
+    0xae, 0x01, 0x03,  // 0580          ldx BUF0+1             ; next directory block
+    0xad, 0x00, 0x03,  // 0583          lda BUF0
+    0xd0, 0x82,        // 0586          bne dirsec
+    0xa2, 0x00,        // 0588 error:   ldx #$00               ; ready
+    0x8e, 0x00, 0x18,  // 058a          stx PORT
+    0xa9, 0xff,        // 058d          lda #$ff
+    0x20, 0xc8, 0x05,  // 058f          jsr send               ; error status
+    0x20, 0xb3, 0x05,  // 0592          jsr ack
+    0xa9, 0x00,        // 0595 exit:    lda #$00               ; release the bus
+    0x8d, 0x00, 0x18,  // 0597          sta PORT
+    0xad, 0x01, 0x18,  // 059a          lda $1801              ; clear pending ATN interrupt
+    0x58,              // 059d          cli
+    0x60,              // 059e          rts
+    0x85, 0x06,        // 059f readsec: sta TRK0               ; read block A/X into buffer 0
+    0x86, 0x07,        // 05a1          stx SEC0
+    0xad, 0x01, 0x18,  // 05a3          lda $1801
+    0xa9, 0x80,        // 05a6          lda #$80
+    0x85, 0x00,        // 05a8          sta JOB0
+    0x58,              // 05aa          cli
+    0xa5, 0x00,        // 05ab rwait:   lda JOB0
+    0x30, 0xfc,        // 05ad          bmi rwait
+    0x78,              // 05af          sei
+    0xc9, 0x02,        // 05b0          cmp #$02               ; carry set on error
+    0x60,              // 05b2          rts
+    0x2c, 0x00, 0x18,  // 05b3 ack:     bit PORT               ; wait ATN assert, busy
+    0x10, 0xfb,        // 05b6          bpl ack
+    0xa9, 0x18,        // 05b8          lda #$18
+    0x8d, 0x00, 0x18,  // 05ba          sta PORT
+    0x2c, 0x00, 0x18,  // 05bd ack2:    bit PORT               ; wait ATN release, still busy
+    0x30, 0xfb,        // 05c0          bmi ack2
+    0xa9, 0x08,        // 05c2          lda #$08
+    0x8d, 0x00, 0x18,  // 05c4          sta PORT
+    0x60,              // 05c7          rts
+    0x8c, 0x27, 0x06,  // 05c8 send:    sty savey              ; send A, two bits per ATN edge
+    0xaa,              // 05cb          tax
+    0x4a,              // 05cc          lsr
+    0x4a,              // 05cd          lsr
+    0x4a,              // 05ce          lsr
+    0x4a,              // 05cf          lsr
+    0xa8,              // 05d0          tay
+    0x8a,              // 05d1          txa
+    0x29, 0x0f,        // 05d2          and #$0f
+    0xaa,              // 05d4          tax
+    0x2c, 0x00, 0x18,  // 05d5 s1:      bit PORT
+    0x10, 0xfb,        // 05d8          bpl s1
+    0xb9, 0x05, 0x06,  // 05da          lda taba,y
+    0x8d, 0x00, 0x18,  // 05dd          sta PORT
+    0x2c, 0x00, 0x18,  // 05e0 s2:      bit PORT
+    0x30, 0xfb,        // 05e3          bmi s2
+    0xb9, 0x15, 0x06,  // 05e5          lda tabr,y
+    0x8d, 0x00, 0x18,  // 05e8          sta PORT
+    0x2c, 0x00, 0x18,  // 05eb s3:      bit PORT
+    0x10, 0xfb,        // 05ee          bpl s3
+    0xbd, 0x05, 0x06,  // 05f0          lda taba,x
+    0x8d, 0x00, 0x18,  // 05f3          sta PORT
+    0x2c, 0x00, 0x18,  // 05f6 s4:      bit PORT
+    0x30, 0xfb,        // 05f9          bmi s4
+    0xbd, 0x15, 0x06,  // 05fb          lda tabr,x
+    0x8d, 0x00, 0x18,  // 05fe          sta PORT
+    0xac, 0x27, 0x06,  // 0601          ldy savey
+    0x60,              // 0604          rts
+    0x10, 0x10, 0x10, 0x10, 0x18, 0x18, 0x18, 0x18, // 0605 taba:
+    0x12, 0x12, 0x12, 0x12, 0x1a, 0x1a, 0x1a, 0x1a,
+    0x00, 0x08, 0x02, 0x0a, 0x00, 0x08, 0x02, 0x0a, // 0615 tabr:
+    0x00, 0x08, 0x02, 0x0a, 0x00, 0x08, 0x02, 0x0a,
+    0x00, // 0625 ent:
+    0x00, // 0626 count:
+    0x00, // 0627 savey:
+    0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, // 0628 name:
+    0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0,
+};
+
+static uint8_t block[254];      // Last block received from the drive
+static uint8_t block_size;      // Bytes in current block
+static uint8_t block_position;  // Next byte to be returned
+static uint8_t block_status;    // Status of current block
+static bool transfer_active;    // Drive routine is running and owns the bus
+
+static uint8_t bus_released;    // CIA2 port A values with ATN released...
+static uint8_t bus_atn;         // ...and asserted, VIC bank bits are preserved
+static uint8_t received_byte;
+
+/*
+ * Sends a memory command (M-R, M-W, M-E) to the command channel, already open as logical file 15
+ * M-W needs the byte count before the data, DOS takes it from the sixth command byte
+ * M-R gets its count as data, M-E has no data at all
+ */
+static void memory_command(char type, uint16_t address, const uint8_t *data, uint8_t size)
+{
+    char command[6 + MEMORY_WRITE_CHUNK];
+    uint8_t length = 5;
+    command[0] = 'M';
+    command[1] = '-';
+    command[2] = type;
+    command[3] = address & 0xff;
+    command[4] = address >> 8;
+    if (type == 'W') command[length++] = size;
+    memcpy(command + length, data, size);
+    krnio_write(15, command, length + size);
+}
+
+/*
+ * DOS ROM identifies itself as "... 1541" at 0xe5c5, a 1571 has a '7' where a 1541 has its '4'
+ */
+static bool drive_is_1541(void)
+{
+    uint8_t count = 1;
+    memory_command('R', 0xe5c6, &count, 1);
+    int ch = krnio_getch(15);
+    return ch >= 0 && (ch & 0xff) == '4';
+}
+
+/*
+ * Receives a byte, two bits for every ATN edge: bits come inverted and most significant pair first
+ */
+static uint8_t receive_byte(void)
+{
+    __asm {
+        lda bus_atn
+        sta $dd00
+        ldx #DELAY_FIRST_PAIR
+    w1: dex
+        bne w1
+        lda $dd00
+        and #$c0
+        sta received_byte
+
+        lda bus_released
+        sta $dd00
+        ldx #DELAY_PAIR
+    w2: dex
+        bne w2
+        lda $dd00
+        and #$c0
+        lsr
+        lsr
+        ora received_byte
+        sta received_byte
+
+        lda bus_atn
+        sta $dd00
+        ldx #DELAY_PAIR
+    w3: dex
+        bne w3
+        lda $dd00
+        and #$c0
+        lsr
+        lsr
+        lsr
+        lsr
+        ora received_byte
+        sta received_byte
+
+        lda bus_released
+        sta $dd00
+        ldx #DELAY_PAIR
+    w4: dex
+        bne w4
+        lda $dd00
+        and #$c0
+        lsr
+        lsr
+        lsr
+        lsr
+        lsr
+        lsr
+        ora received_byte
+        eor #$ff
+        sta received_byte
+    }
+    return received_byte;
+}
+
+/*
+ * ATN pulse closing a block, the drive goes busy on the assertion
+ * The long wait after the release lets the drive routine return to DOS before the KERNAL touches the bus again
+ */
+static void acknowledge(void)
+{
+    __asm {
+        lda bus_atn
+        sta $dd00
+        ldx #DELAY_FIRST_PAIR
+    a1: dex
+        bne a1
+        lda bus_released
+        sta $dd00
+        ldx #DELAY_FIRST_PAIR
+    a2: dex
+        bne a2
+    }
+}
+
+/*
+ * Receives the next block, returns false on errors
+ */
+static bool receive_block(void)
+{
+    // Wait while the drive reads the block from disk
+    while (!(cia2.pra & BUS_CLK_IN));
+
+    block_status = receive_byte();
+    block_size = 0;
+    block_position = 0;
+    if (block_status != BLOCK_ERROR) {
+        uint8_t size = receive_byte();
+        for(uint8_t i = 0; i < size; i++) {
+            block[i] = receive_byte();
+        }
+        block_size = size;
+    }
+    acknowledge();
+
+    if (block_status != BLOCK_MORE) {
+        // Drive routine has ended, DOS is in charge again
+        transfer_active = false;
+        krnio_close(15);
+    }
+    return block_status != BLOCK_ERROR;
+}
+
+/*
+ * Tells whether the drive routine is still in drive RAM from a previous transfer
+ * DOS fills a whole buffer when it uses one, so the start of each page the routine takes is enough to check
+ */
+static bool drive_code_resident(void)
+{
+    for(uint16_t offset = 0; offset < sizeof(drive_code); offset += 0x100) {
+        uint8_t count = RESIDENT_CHECK;
+        uint8_t matching = 0;
+        memory_command('R', DRIVE_CODE_ADDRESS + offset, &count, 1);
+        for(uint8_t i = 0; i < RESIDENT_CHECK; i++) {
+            int ch = krnio_getch(15);
+            if (ch >= 0 && (ch & 0xff) == drive_code[offset + i]) matching++;
+        }
+        if (matching != RESIDENT_CHECK) return false;
+    }
+    return true;
+}
+
+bool fastload_open(uint8_t device, const char *filename)
+{
+    uint8_t name[DRIVE_NAME_LENGTH];
+
+    krnio_setnam("");
+    if (!krnio_open(15, (char)device, 15)) return false;
+    if (!drive_is_1541()) {
+        krnio_close(15);
+        return false;
+    }
+
+    // Uploading takes a while on the standard serial bus, it's only done when the routine is gone
+    // (first transfer of the session, or DOS used those buffers for regular file access meanwhile)
+    if (!drive_code_resident()) {
+        for(uint16_t offset = 0; offset < sizeof(drive_code); offset += MEMORY_WRITE_CHUNK) {
+            uint16_t size = sizeof(drive_code) - offset;
+            memory_command('W', DRIVE_CODE_ADDRESS + offset, drive_code + offset, size < MEMORY_WRITE_CHUNK ? size : MEMORY_WRITE_CHUNK);
+        }
+    }
+
+    memset(name, 0xa0, DRIVE_NAME_LENGTH);
+    for(uint8_t i = 0; i < DRIVE_NAME_LENGTH && filename[i] && filename[i] != ','; i++) {
+        name[i] = filename[i];
+    }
+    memory_command('W', DRIVE_NAME_ADDRESS, name, DRIVE_NAME_LENGTH);
+
+    bus_released = cia2.pra & 0x07;
+    bus_atn = bus_released | BUS_ATN_OUT;
+
+    // The routine starts as soon as the command channel is unlistened, it pulls CLK low right away.
+    // If that doesn't happen the drive didn't take the code, stay with the KERNAL
+    memory_command('E', DRIVE_CODE_ADDRESS, NULL, 0);
+    uint16_t timeout = 0;
+    while (cia2.pra & BUS_CLK_IN) {
+        if (!--timeout) {
+            krnio_close(15);
+            return false;
+        }
+    }
+
+    transfer_active = true;
+    block_status = BLOCK_MORE;
+    block_size = 0;
+    block_position = 0;
+    return true;
+}
+
+int fastload_getch(void)
+{
+    if (block_position == block_size) {
+        if (block_status != BLOCK_MORE || !receive_block() || !block_size) return -1;
+    }
+    int ch = block[block_position++];
+    if (block_position == block_size && block_status == BLOCK_LAST) ch |= 0x100;
+    return ch;
+}
+
+void fastload_close(void)
+{
+    while (transfer_active && receive_block());
+}
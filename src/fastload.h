@@ -0,0 +1,36 @@
+#ifndef PB_FASTLOAD_H
+#define PB_FASTLOAD_H
+
+#include <stdint.h>
+
+/*
+ * 1541 fast loader
+ *
+ * A small routine is uploaded into drive RAM, it looks the file up in the directory
+ * and sends its blocks two bits at a time over CLK and DATA lines, while the C64 clocks
+ * every bit pair toggling ATN. The C64 side only ever waits longer than needed between
+ * a toggle and the following read, so raster interrupts and badlines can't break the transfer
+ * and there's no need to disable interrupts or blank the screen.
+ * The drive must be the only device on the serial bus during the transfer.
+ */
+
+/*
+ * Starts loading a file (name can carry ",U,R" like suffixes, they are ignored)
+ * Returns false when the device is not a 1541, regular KERNAL I/O has to be used in this case
+ */
+bool fastload_open(uint8_t device, const char *filename);
+
+/*
+ * Returns the next byte of the file, the last one comes with bit 8 set (0x100),
+ * after that or in case of errors -1 is returned. Same convention of krnio_getch()
+ */
+int fastload_getch(void);
+
+/*
+ * Skips what's left of the file and gives the bus back to the KERNAL
+ */
+void fastload_close(void);
+
+#pragma compile("fastload.c")
+
+#endif
@@ -0,0 +1,25 @@
+#include "inputmask.h"
+
+// Generated by tools/input_mask.py, do not edit
+
+const uint8_t input_map[INPUT_MAPPED_SIZE] = {
+      0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,  15,
+     16,  17,  18,  19,  20,  21,  22,  29,  30,  31,  32,  33,  34,  35,  36,  44,
+     45,  46,  47,  48,  49,  50,  51,  52,  58,  59,  60,  61,  62,  63,  64,  65,
+     66,  67,  68,  73,  74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  87,
+     88,  89,  90,  91,  92,  93,  94,  95,  96,  97,  98,  99, 100, 101, 102, 103,
+    104, 105, 106, 107, 108, 109, 110, 111, 112, 113, 114, 117, 118, 119, 120, 121,
+    122, 123, 126, 127, 128, 129, 130, 133, 134, 135, 136, 137, 138, 140, 141, 142,
+    143, 144, 145, 146, 147, 148, 149, 150, 151, 152, 153, 154, 156, 157, 158, 159,
+    160, 161, 162, 163, 164, 165, 166, 167, 168, 169, 171, 172, 173, 174, 175, 176,
+    177, 178, 179, 180, 181, 182, 183, 187, 188, 189, 190, 191, 192, 193, 194, 195,
+    203, 204, 205, 206, 207, 208, 209, 210, 211, 220, 221, 222, 225, 226, 227, 228,
+    229, 230, 231, 232, 233, 234, 235, 236, 237, 238, 244, 245, 246, 247, 248, 253,
+};
+
+const uint8_t input_mask[32] = {
+    0xff, 0xff, 0xfe, 0x07, 0xf8, 0x0f, 0xf8, 0x3f,
+    0xf8, 0x7f, 0xf9, 0xff, 0xff, 0xff, 0xe7, 0xf3,
+    0xe7, 0xef, 0xff, 0xef, 0xff, 0xdf, 0xff, 0x1f,
+    0xf0, 0x1f, 0xf0, 0x0e, 0x7f, 0xfe, 0x0f, 0x84,
+};
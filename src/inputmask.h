@@ -0,0 +1,19 @@
+#ifndef PB_INPUT_MASK_H
+#define PB_INPUT_MASK_H
+
+#include <stdint.h>
+
+// Generated by tools/input_mask.py, do not edit
+
+// Number of pixels actually fed to the network
+#define INPUT_MAPPED_SIZE 192
+
+// Pixel index (0-255) of every network input
+extern const uint8_t input_map[INPUT_MAPPED_SIZE];
+
+// Kept pixels as a bit mask, same layout as input_t
+extern const uint8_t input_mask[32];
+
+#pragma compile("inputmask.c")
+
+#endif
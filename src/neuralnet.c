@@ -1,6 +1,7 @@
 #include <math.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include "neuralnet.h"
 
 /*
@@ -30,6 +31,12 @@ SOFTWARE.
 // where dimensions are 16x16 boolean values
 #define EXTRACT_BIT(arr, i) ((arr)[(i) >> 3] >> (7 - ((i) & 7)) & 1)
 
+// Number of bits set in a byte
+#define POPCOUNT2(n) n, n + 1, n + 1, n + 2
+#define POPCOUNT4(n) POPCOUNT2(n), POPCOUNT2(n + 1), POPCOUNT2(n + 1), POPCOUNT2(n + 2)
+#define POPCOUNT6(n) POPCOUNT4(n), POPCOUNT4(n + 1), POPCOUNT4(n + 1), POPCOUNT4(n + 2)
+static const uint8_t popcount_table[256] = { POPCOUNT6(0), POPCOUNT6(1), POPCOUNT6(1), POPCOUNT6(2) };
+
 float rand_float()
 {
     return (float)rand() / UINT_MAX;
@@ -47,10 +54,16 @@ float sigmoid_prime(float x)
 
 void init_network(NeuralNetwork *neural_network)
 {
-    for(unsigned int i = 0; i < (INPUT_LAYER_SIZE * HIDDEN_LAYER_SIZE); i++) {
-        neural_network->weights_hidden[i] = rand_float() - 0.5;
+    float row[HIDDEN_LAYER_SIZE];
+    neural_network->hidden_count = HIDDEN_LAYER_SIZE;
+    set_dirty(neural_network, true);
+    for(uint8_t i = 0; i < NETWORK_INPUT_SIZE; i++) {
+        for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+            row[h] = rand_float() - 0.5;
+        }
+        set_weights_row(neural_network, i, row);
     }
-    for(uint8_t h = 0; h < HIDDEN_LAYER_SIZE; h++) {
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
         neural_network->biases_hidden[h] = 0.0;
     }
     for(uint8_t h = 0; h < (HIDDEN_LAYER_SIZE * OUTPUT_LAYER_SIZE); h++) {
@@ -61,25 +74,59 @@ void init_network(NeuralNetwork *neural_network)
     }
 }
 
-uint8_t predict(NeuralNetwork *neural_network, input_t input)
+void get_weights_row(NeuralNetwork *neural_network, uint8_t input, float row[HIDDEN_LAYER_SIZE])
 {
-    float max_output = -1.0;
-    uint8_t result = 0;
-    
-    for(uint8_t h = 0; h < HIDDEN_LAYER_SIZE; h++) {
-        float sum_hidden = 0.0;
-        for(uint16_t i = 0; i < INPUT_LAYER_SIZE; i++) {
-            if (EXTRACT_BIT(input, i)) {
-                sum_hidden += neural_network->weights_hidden[i * HIDDEN_LAYER_SIZE + h];
-            }
+    float_bytes_t weight;
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        for(uint8_t b = 0; b < FLOAT_BYTES; b++) {
+            weight.bytes[b] = neural_network->weights_hidden[h][b][input];
         }
+        row[h] = weight.value;
+    }
+}
 
-        neural_network->activations_hidden[h] = sigmoid(sum_hidden + neural_network->biases_hidden[h]);
+void set_weights_row(NeuralNetwork *neural_network, uint8_t input, const float row[HIDDEN_LAYER_SIZE])
+{
+    float_bytes_t weight;
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        weight.value = row[h];
+        for(uint8_t b = 0; b < FLOAT_BYTES; b++) {
+            neural_network->weights_hidden[h][b][input] = weight.bytes[b];
+        }
+    }
+}
+
+void set_dirty(NeuralNetwork *neural_network, bool dirty)
+{
+    memset(neural_network->dirty_rows, 0, DIRTY_ROWS_SIZE);
+    neural_network->dirty_all = dirty;
+}
+
+bool is_row_dirty(NeuralNetwork *neural_network, uint8_t input)
+{
+    return neural_network->dirty_rows[input >> 3] & (1 << (input & 7));
+}
+
+uint8_t dirty_rows_count(NeuralNetwork *neural_network)
+{
+    uint8_t count = 0;
+    for(uint8_t i = 0; i < NETWORK_INPUT_SIZE; i++) {
+        count += is_row_dirty(neural_network, i);
     }
+    return count;
+}
+
+/*
+ * Computes the output layer from the hidden activations, returning the most activated output
+ */
+static uint8_t predict_output(NeuralNetwork *neural_network)
+{
+    float max_output = -1.0;
+    uint8_t result = 0;
 
     for(uint8_t o = 0; o < OUTPUT_LAYER_SIZE; o++) {
         float sum_output = 0.0;
-        for(uint8_t h = 0; h < HIDDEN_LAYER_SIZE; h++) {
+        for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
             sum_output += neural_network->activations_hidden[h] * neural_network->weights_output[h * OUTPUT_LAYER_SIZE + o];
         }
         neural_network->activations_output[o] = sigmoid(sum_output + neural_network->biases_output[o]);
@@ -91,7 +138,76 @@ uint8_t predict(NeuralNetwork *neural_network, input_t input)
     return result;
 }
 
-void train(NeuralNetwork *neural_network, input_t input, uint8_t output)
+uint8_t predict(NeuralNetwork *neural_network, input_t input)
+{
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        float sum_hidden = 0.0;
+        // One pointer per byte plane, weights of this neuron are then fetched with the input index alone
+        const uint8_t *plane0 = neural_network->weights_hidden[h][0];
+        const uint8_t *plane1 = neural_network->weights_hidden[h][1];
+        const uint8_t *plane2 = neural_network->weights_hidden[h][2];
+        const uint8_t *plane3 = neural_network->weights_hidden[h][3];
+        float_bytes_t weight;
+        for(uint8_t i = 0; i < NETWORK_INPUT_SIZE; i++) {
+            if (EXTRACT_BIT(input, input_map[i])) {
+                weight.bytes[0] = plane0[i];
+                weight.bytes[1] = plane1[i];
+                weight.bytes[2] = plane2[i];
+                weight.bytes[3] = plane3[i];
+                sum_hidden += weight.value;
+            }
+        }
+
+        neural_network->activations_hidden[h] = sigmoid(sum_hidden + neural_network->biases_hidden[h]);
+    }
+
+    return predict_output(neural_network);
+}
+
+// Hidden layer sums of every record handled by predict_batch()
+static float batch_sums_hidden[PREDICT_BATCH_SIZE][HIDDEN_LAYER_SIZE];
+
+void predict_batch(NeuralNetwork *neural_network, uint8_t (*records)[BATCH_ROW_LENGTH], uint8_t count, uint8_t predictions[])
+{
+    float row[HIDDEN_LAYER_SIZE];
+    uint8_t lit[PREDICT_BATCH_SIZE];
+
+    for(uint8_t k = 0; k < count; k++) {
+        for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+            batch_sums_hidden[k][h] = 0.0;
+        }
+    }
+
+    for(uint8_t i = 0; i < NETWORK_INPUT_SIZE; i++) {
+        // Bit of this input in the packed records
+        uint8_t offset = input_map[i] >> 3;
+        uint8_t mask = 0x80 >> (input_map[i] & 7);
+        uint8_t lit_count = 0;
+        for(uint8_t k = 0; k < count; k++) {
+            if (records[k][offset] & mask) lit[lit_count++] = k;
+        }
+        if (!lit_count) continue;
+
+        // Weights are fetched once and added to every record where the pixel is on,
+        // inputs are walked in the same order as predict() so sums are exactly the same
+        get_weights_row(neural_network, i, row);
+        for(uint8_t l = 0; l < lit_count; l++) {
+            float *sums = batch_sums_hidden[lit[l]];
+            for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+                sums[h] += row[h];
+            }
+        }
+    }
+
+    for(uint8_t k = 0; k < count; k++) {
+        for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+            neural_network->activations_hidden[h] = sigmoid(batch_sums_hidden[k][h] + neural_network->biases_hidden[h]);
+        }
+        predictions[k] = predict_output(neural_network);
+    }
+}
+
+void train(NeuralNetwork *neural_network, input_t input, uint8_t output, float learning_rate)
 {
     uint8_t predicted = predict(neural_network, input);
     
@@ -99,7 +215,7 @@ void train(NeuralNetwork *neural_network, input_t input, uint8_t output)
         neural_network->gradients_output[o] = (neural_network->activations_output[o] - (o == output)) * sigmoid_prime(neural_network->activations_output[o]);
     }
 
-    for(uint8_t h = 0; h < HIDDEN_LAYER_SIZE; h++) {
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
         float gradient_hidden_sum = 0.0;
         for(uint8_t o = 0; o < OUTPUT_LAYER_SIZE; o++) {
             gradient_hidden_sum += neural_network->gradients_output[o] * neural_network->weights_output[h * OUTPUT_LAYER_SIZE + o];
@@ -107,23 +223,183 @@ void train(NeuralNetwork *neural_network, input_t input, uint8_t output)
         neural_network->gradients_hidden[h] = gradient_hidden_sum * sigmoid_prime(neural_network->activations_hidden[h]);
     }
 
-    for(uint8_t h = 0; h < HIDDEN_LAYER_SIZE; h++) {
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
         for(uint8_t o = 0; o < OUTPUT_LAYER_SIZE; o++) {
-            neural_network->weights_output[h * OUTPUT_LAYER_SIZE + o] -= LEARNING_RATE * neural_network->gradients_output[o] * neural_network->activations_hidden[h];
+            neural_network->weights_output[h * OUTPUT_LAYER_SIZE + o] -= learning_rate * neural_network->gradients_output[o] * neural_network->activations_hidden[h];
         }
     }
 
-    for(uint16_t i = 0; i < INPUT_LAYER_SIZE; i++) {
-        for(uint8_t h = 0; h < HIDDEN_LAYER_SIZE; h++) {
-            neural_network->weights_hidden[i * HIDDEN_LAYER_SIZE + h] -= LEARNING_RATE * neural_network->gradients_hidden[h] * (float)EXTRACT_BIT(input, i);
+    // Weights of unlit inputs would be decreased by zero, only lit ones need an update (and a save)
+    for(uint8_t i = 0; i < NETWORK_INPUT_SIZE; i++) {
+        if (EXTRACT_BIT(input, input_map[i])) neural_network->dirty_rows[i >> 3] |= 1 << (i & 7);
+    }
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        float delta = learning_rate * neural_network->gradients_hidden[h];
+        uint8_t *plane0 = neural_network->weights_hidden[h][0];
+        uint8_t *plane1 = neural_network->weights_hidden[h][1];
+        uint8_t *plane2 = neural_network->weights_hidden[h][2];
+        uint8_t *plane3 = neural_network->weights_hidden[h][3];
+        float_bytes_t weight;
+        for(uint8_t i = 0; i < NETWORK_INPUT_SIZE; i++) {
+            if (EXTRACT_BIT(input, input_map[i])) {
+                weight.bytes[0] = plane0[i];
+                weight.bytes[1] = plane1[i];
+                weight.bytes[2] = plane2[i];
+                weight.bytes[3] = plane3[i];
+                weight.value -= delta;
+                plane0[i] = weight.bytes[0];
+                plane1[i] = weight.bytes[1];
+                plane2[i] = weight.bytes[2];
+                plane3[i] = weight.bytes[3];
+            }
         }
     }
 
     for(uint8_t o = 0; o < OUTPUT_LAYER_SIZE; o++) {
-        neural_network->biases_output[o] -= LEARNING_RATE * neural_network->gradients_output[o];
+        neural_network->biases_output[o] -= learning_rate * neural_network->gradients_output[o];
     }
 
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        neural_network->biases_hidden[h] -= learning_rate * neural_network->gradients_hidden[h];
+    }
+}
+
+void init_hidden_stats(HiddenStats *stats)
+{
     for(uint8_t h = 0; h < HIDDEN_LAYER_SIZE; h++) {
-        neural_network->biases_hidden[h] -= LEARNING_RATE * neural_network->gradients_hidden[h];
+        stats->sum[h] = 0.0;
+        stats->sum_squares[h] = 0.0;
+    }
+    stats->count = 0;
+}
+
+void collect_hidden_stats(NeuralNetwork *neural_network, HiddenStats *stats)
+{
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        float activation = neural_network->activations_hidden[h];
+        stats->sum[h] += activation;
+        stats->sum_squares[h] += activation * activation;
+    }
+    stats->count++;
+}
+
+/*
+ * Removes hidden neuron h, replacing it with the last one in use
+ */
+static void remove_hidden(NeuralNetwork *neural_network, HiddenStats *stats, uint8_t h)
+{
+    uint8_t last = --neural_network->hidden_count;
+    float mean = stats->sum[h] / stats->count;
+
+    // Outputs keep getting the average contribution of the removed neuron
+    for(uint8_t o = 0; o < OUTPUT_LAYER_SIZE; o++) {
+        neural_network->biases_output[o] += mean * neural_network->weights_output[h * OUTPUT_LAYER_SIZE + o];
+    }
+
+    if (h != last) {
+        memcpy(neural_network->weights_hidden[h], neural_network->weights_hidden[last], sizeof(weight_planes_t));
+        memcpy(&neural_network->weights_output[h * OUTPUT_LAYER_SIZE], &neural_network->weights_output[last * OUTPUT_LAYER_SIZE], OUTPUT_LAYER_SIZE * sizeof(float));
+        neural_network->biases_hidden[h] = neural_network->biases_hidden[last];
+        stats->sum[h] = stats->sum[last];
+        stats->sum_squares[h] = stats->sum_squares[last];
+    }
+    // Unused neurons show up as empty in the activations histogram
+    neural_network->activations_hidden[last] = 0.0;
+}
+
+uint8_t prune_hidden(NeuralNetwork *neural_network, HiddenStats *stats)
+{
+    float importance[HIDDEN_LAYER_SIZE];
+    float max_importance = 0.0;
+    uint8_t removed = 0;
+
+    if (!stats->count) return 0;
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        float mean = stats->sum[h] / stats->count;
+        float variance = stats->sum_squares[h] / stats->count - mean * mean;
+        float weights = 0.0;
+        for(uint8_t o = 0; o < OUTPUT_LAYER_SIZE; o++) {
+            weights += fabs(neural_network->weights_output[h * OUTPUT_LAYER_SIZE + o]);
+        }
+        importance[h] = (variance > 0.0 ? sqrt(variance) : 0.0) * weights;
+        if (importance[h] > max_importance) max_importance = importance[h];
+    }
+
+    // Least important neurons go first
+    while(neural_network->hidden_count > PRUNE_HIDDEN_MIN) {
+        uint8_t weakest = 0;
+        for(uint8_t h = 1; h < neural_network->hidden_count; h++) {
+            if (importance[h] < importance[weakest]) weakest = h;
+        }
+        if (importance[weakest] >= max_importance * PRUNE_THRESHOLD) break;
+        importance[weakest] = importance[neural_network->hidden_count - 1];
+        remove_hidden(neural_network, stats, weakest);
+        removed++;
     }
-}
\ No newline at end of file
+    // Every saved row has a different size now
+    if (removed) set_dirty(neural_network, true);
+    return removed;
+}
+
+void binarize_hidden(NeuralNetwork *neural_network, BinaryLayer *layer)
+{
+    float row[HIDDEN_LAYER_SIZE];
+    float threshold[HIDDEN_LAYER_SIZE];
+    uint8_t kept[HIDDEN_LAYER_SIZE];
+
+    memset(layer->positive, 0, sizeof(layer->positive));
+    memset(layer->negative, 0, sizeof(layer->negative));
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        threshold[h] = 0.0;
+        layer->scale[h] = 0.0;
+        kept[h] = 0;
+    }
+
+    // Small weights are dropped, how small depends on the neuron
+    for(uint8_t i = 0; i < NETWORK_INPUT_SIZE; i++) {
+        get_weights_row(neural_network, i, row);
+        for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+            threshold[h] += fabs(row[h]);
+        }
+    }
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        threshold[h] *= BINARY_THRESHOLD / NETWORK_INPUT_SIZE;
+    }
+
+    for(uint8_t i = 0; i < NETWORK_INPUT_SIZE; i++) {
+        // Masks cover all the pixels, the ones not mapped to a network input are never set
+        uint8_t offset = input_map[i] >> 3;
+        uint8_t mask = 0x80 >> (input_map[i] & 7);
+        get_weights_row(neural_network, i, row);
+        for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+            if (row[h] > threshold[h]) {
+                layer->positive[h][offset] |= mask;
+                layer->scale[h] += row[h];
+                kept[h]++;
+            } else if (row[h] < -threshold[h]) {
+                layer->negative[h][offset] |= mask;
+                layer->scale[h] -= row[h];
+                kept[h]++;
+            }
+        }
+    }
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        if (kept[h]) layer->scale[h] /= kept[h];
+    }
+}
+
+uint8_t predict_binary(NeuralNetwork *neural_network, const BinaryLayer *layer, input_t input)
+{
+    for(uint8_t h = 0; h < neural_network->hidden_count; h++) {
+        const uint8_t *positive = layer->positive[h];
+        const uint8_t *negative = layer->negative[h];
+        int count = 0;
+        for(uint8_t b = 0; b < BATCH_ROW_LENGTH - 1; b++) {
+            uint8_t pixels = input[b];
+            count += popcount_table[pixels & positive[b]];
+            count -= popcount_table[pixels & negative[b]];
+        }
+        neural_network->activations_hidden[h] = sigmoid(layer->scale[h] * count + neural_network->biases_hidden[h]);
+    }
+    return predict_output(neural_network);
+}
@@ -2,12 +2,10 @@
 #define PB_NEURAL_NETWORK_H
 
 #include <stdint.h>
+#include "inputmask.h"
 
 // Hyperparmeters
 
-// Every batch of training hadwritten digits can store up to 100 items
-#define BATCH_ROW_COUNT_MAX 100
-
 // Record length = 16 * 2 (pixels) bytes + 1 (digit) byte
 // This is a compressed representation of initial training digit data structure:
 // Every row was formed by a sequence of 256 float values (with only two values: 1.0 or 0.0) followed by ten boolean (1/0) digits
@@ -15,18 +13,44 @@
 #define BATCH_ROW_LENGTH 33 
 // Every digit is drawn in a 16 * 16 pixel box, so our input layer is an array of 256 sensors
 #define INPUT_LAYER_SIZE (16 * 16)
+// ...but only the pixels selected by tools/input_mask.py are actually connected to the network,
+// input_map tells which pixel feeds every network input
+#define NETWORK_INPUT_SIZE INPUT_MAPPED_SIZE
+#if NETWORK_INPUT_SIZE > 255
+#error "Network inputs are walked with an 8 bit index, at most 255 pixels can be mapped"
+#endif
 // 14 hidden neurons are enough
 #define HIDDEN_LAYER_SIZE 14
 // Every output neuron is "mapped" to a specific digit from 0 to 9 by its position 
 #define OUTPUT_LAYER_SIZE 10
+// Initial learning rate, the training schedule lowers it when validation accuracy stops improving
 #define LEARNING_RATE 0.5
-// Total digits in training set
-#define TRAINING_RECORD_COUNT 1593
-// Two epochs are usually enough for an accuracy of 90-95%
-#define EPOCHS 2
-
-// Every batch is kept in memory for performance reasons
-typedef uint8_t batch_t[BATCH_ROW_COUNT_MAX][BATCH_ROW_LENGTH];
+// Two epochs are usually enough for an accuracy of 90-95%, this is just an upper bound
+// since the training schedule stops as soon as accuracy reaches a plateau
+#define EPOCHS 3
+// After training, hidden neurons whose importance is below this fraction of the most important one are removed
+// (on the host 0.4 removes 0-2 neurons for up to 1.4 points of accuracy, above 0.45 accuracy starts dropping fast)
+#define PRUNE_THRESHOLD 0.4
+// ...but never go below this many hidden neurons
+#define PRUNE_HIDDEN_MIN 8
+// Binarized hidden layer: weights smaller than this fraction of their neuron's mean magnitude become zero,
+// the others are reduced to their sign
+#define BINARY_THRESHOLD 0.7
+// Records predicted together by predict_batch(): every weight fetched from memory is used for all of them
+#define PREDICT_BATCH_SIZE 8
+
+// Training schedule
+
+// Validation accuracy is checked every time at least this many records have been used for training
+#define VALIDATION_INTERVAL 500
+// Training stops once validation accuracy (in percent) reaches this value...
+#define TARGET_ACCURACY 92
+// ...every check without improvement multiplies the learning rate by this factor...
+#define LEARNING_RATE_DECAY 0.5
+// ...and when it falls below this value we've hit a plateau, training stops
+#define LEARNING_RATE_MIN 0.2
+// Fine-tuning on user drawn digits takes smaller steps, network is already trained
+#define FINETUNE_LEARNING_RATE 0.2
 
 // 32 bytes representing digit pixels, every bit is a specific pixel
 // We can cycle through pixels using the expression
@@ -34,12 +58,34 @@ typedef uint8_t batch_t[BATCH_ROW_COUNT_MAX][BATCH_ROW_LENGTH];
 // where i is pixel index in loop from 0 to 255, starting from topmost left to bottom right pixel  
 typedef uint8_t input_t[BATCH_ROW_LENGTH - 1];
 
+// Size in bytes of a float
+#define FLOAT_BYTES 4
+
+// Gives access to single bytes of a float
+typedef union {
+    float value;
+    uint8_t bytes[FLOAT_BYTES];
+} float_bytes_t;
+
+// Bytes needed to flag every network input with a bit
+#define DIRTY_ROWS_SIZE ((NETWORK_INPUT_SIZE + 7) / 8)
+
+// Hidden weights of a single neuron, split in byte planes: byte b of the weight connecting
+// network input i is stored at [b][i]. This way the 6502 can fetch a whole weight using four
+// absolute indexed loads sharing the same 8 bit index, with no 16 bit address arithmetic
+typedef uint8_t weight_planes_t[FLOAT_BYTES][NETWORK_INPUT_SIZE];
+
+// Planes are NETWORK_INPUT_SIZE (192) bytes long, so only the first one starts on a page boundary: in every
+// four planes one of them crosses a page after 64 inputs and another after 128, and those loads take a cycle more.
+// That's about a quarter of the weight loads, a cycle each next to a float addition of a few hundred cycles,
+// not worth the 3.5 KB that padding every plane to 256 bytes would take
 typedef struct {
     // Input layer values are those read from data, they basically are the pixel of the digit
     // which can either be "on" or "off": 1.0 or 0.0, there's no need to create another structure for a replica of these values
 
     // Hidden layer: weights, biases and activation values
-    float weights_hidden[INPUT_LAYER_SIZE * HIDDEN_LAYER_SIZE]; // Every input sensor is connected to a hidden neuron, here are stored the weights of every connection
+    // Only the first hidden_count neurons are in use, the others have been pruned
+    weight_planes_t weights_hidden[HIDDEN_LAYER_SIZE]; // Every mapped input sensor is connected to a hidden neuron, here are stored the weights of every connection
     float biases_hidden[HIDDEN_LAYER_SIZE];
     float activations_hidden[HIDDEN_LAYER_SIZE];
 
@@ -50,8 +96,30 @@ typedef struct {
 
     float gradients_hidden[HIDDEN_LAYER_SIZE];
     float gradients_output[OUTPUT_LAYER_SIZE];
+
+    uint8_t hidden_count; // Hidden neurons in use, HIDDEN_LAYER_SIZE until the network gets pruned
+
+    // Changes since parameters were last saved or loaded, so that a save can be limited to what's different
+    uint8_t dirty_rows[DIRTY_ROWS_SIZE]; // One bit for every network input whose hidden weights row changed
+    bool dirty_all;                      // Parameters changed as a whole (new or pruned network), only a full save will do
 } NeuralNetwork;
 
+// Hidden neurons activation statistics, collected over a sample of the dataset to decide which neurons can be pruned
+typedef struct {
+    float sum[HIDDEN_LAYER_SIZE];
+    float sum_squares[HIDDEN_LAYER_SIZE];
+    uint16_t count;
+} HiddenStats;
+
+// Hidden layer reduced to ternary weights (+1, 0, -1) over the raw 256 pixels, built from the float weights by binarize_hidden()
+// A neuron's input sum is then scale * (lit pixels with positive weight - lit pixels with negative weight),
+// which only takes a few ANDs and popcount table lookups per input byte
+typedef struct {
+    uint8_t positive[HIDDEN_LAYER_SIZE][BATCH_ROW_LENGTH - 1];  // Pixels with positive weight, same bit layout of input_t
+    uint8_t negative[HIDDEN_LAYER_SIZE][BATCH_ROW_LENGTH - 1];  // Pixels with negative weight
+    float scale[HIDDEN_LAYER_SIZE];                             // Mean magnitude of the weights that were kept
+} BinaryLayer;
+
 // Neural network state
 enum NeuralNetworkState {
 	NS_INITIAL			// Initial state, not trained yet, weights are random 
@@ -72,9 +140,71 @@ float sigmoid_prime(float x);
  */
 void init_network(NeuralNetwork *neural_network);
 
+/*
+ * Copies the hidden weights of a network input in row, one for every hidden neuron in use
+ * This is also the order used by the model file (WH), which is a sequence of such rows
+ */
+void get_weights_row(NeuralNetwork *neural_network, uint8_t input, float row[HIDDEN_LAYER_SIZE]);
+
+/*
+ * Sets the hidden weights of a network input from row, see get_weights_row()
+ */
+void set_weights_row(NeuralNetwork *neural_network, uint8_t input, const float row[HIDDEN_LAYER_SIZE]);
+
+/*
+ * Flags all the parameters as changed, or clears every change flag once parameters have been saved or loaded
+ */
+void set_dirty(NeuralNetwork *neural_network, bool dirty);
+
+/*
+ * Tells whether the hidden weights row of a network input changed since parameters were last saved or loaded
+ */
+bool is_row_dirty(NeuralNetwork *neural_network, uint8_t input);
+
+/*
+ * Number of hidden weights rows changed since parameters were last saved or loaded
+ */
+uint8_t dirty_rows_count(NeuralNetwork *neural_network);
+
 uint8_t predict(NeuralNetwork *neural_network, input_t input);
 
-void train(NeuralNetwork *neural_network, input_t input, uint8_t output);
+/*
+ * Predicts count records (at most PREDICT_BATCH_SIZE) at once, storing the guessed digits in predictions
+ * Results are the same as calling predict() on every record, but hidden weights are walked only once
+ * Network activations are left as computed for the last record
+ */
+void predict_batch(NeuralNetwork *neural_network, uint8_t (*records)[BATCH_ROW_LENGTH], uint8_t count, uint8_t predictions[]);
+
+void train(NeuralNetwork *neural_network, input_t input, uint8_t output, float learning_rate);
+
+/*
+ * Builds the binarized version of the hidden layer, float weights are kept as they are and keep on being the ones trained
+ * It has to be built again whenever the network gets trained
+ */
+void binarize_hidden(NeuralNetwork *neural_network, BinaryLayer *layer);
+
+/*
+ * Same as predict(), but the hidden layer is computed with its binarized version
+ */
+uint8_t predict_binary(NeuralNetwork *neural_network, const BinaryLayer *layer, input_t input);
+
+/*
+ * Clears hidden neurons statistics
+ */
+void init_hidden_stats(HiddenStats *stats);
+
+/*
+ * Adds the hidden activations computed by the last predict() to the statistics
+ */
+void collect_hidden_stats(NeuralNetwork *neural_network, HiddenStats *stats);
+
+/*
+ * Removes the hidden neurons which barely affect the outputs, returns how many have been removed
+ * A neuron's importance is the spread of its activation times the size of its output weights:
+ * its mean activation is folded into the output biases, so a neuron with an almost constant output is hardly missed
+ * Remaining neurons are compacted at the beginning of the hidden layer
+ */
+uint8_t prune_hidden(NeuralNetwork *neural_network, HiddenStats *stats);
 
 #pragma compile("neuralnet.c")
 
@@ -15,6 +15,10 @@
 #include <c64/rasterirq.h>
 #include "neuralnet.h"
 #include "batch.h"
+#include "arena.h"
+#ifdef BENCHMARK
+#include "benchmark.h"
+#endif
 
 /*
 MIT License
@@ -39,9 +43,10 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
-#pragma region(main, 0x0a00, 0xcc00, , , {code, data, bss, heap, stack})
+// Heap and stack stay below 0xb700: from there up to the sprites the startup data is loaded and later adopted by the arena allocator
+#pragma region(main, 0x0a00, 0xb700, , , {code, data, bss, heap, stack})
 
-// Load custom charset at 0xc000, we'll copy it later where needed (0xd000) and reuse this memory area as sprite data
+// Load custom charset at 0xc000, we'll copy it later where needed (0xd000) and reuse this memory area for sprites and buffers
 #pragma section(charset, 0)
 #pragma region(charset, 0xc000, 0xc800, , , {charset})
 #pragma data(charset)
@@ -86,12 +91,22 @@ const char sprite_data[] = {
 #define Screen	((char *)0xcc00)
 #define Charset	((char *)0xd000)
 #define Color	((char *)0xd800)
-#define Sprite0 ((char *)0xc000)
+// Sprites are placed at the end of the charset area, so that startup data regions
+// (sprites, petmate and charset: 0xb700-0xc780) form a single block for the arena
+#define Sprite0 ((char *)0xc780)
+#define ArenaStart ((char *)0xb700)
+// Free memory between sprites and screen, claimed by no region
+#define ArenaGap ((char *)0xc800)
 #define LightPenX ((char *)0xd013)
 #define LightPenY ((char *)0xd014)
 
 #define DRIVE_NO 8
 
+// Parameter changes saved after the full model files (WH, WO, BH, BO) are appended to this file
+#define JOURNAL_FILENAME "WJ"
+// Changes are journaled as long as at most this many hidden weights rows changed, otherwise a full save is cheaper
+#define JOURNAL_ROWS_MAX (NETWORK_INPUT_SIZE / 2)
+
 // Terminal window dimensions in screen characters
 #define TERMINAL_TOP    19
 #define TERMINAL_LEFT   1
@@ -119,8 +134,6 @@ const char sprite_data[] = {
 #define CANVAS_PIXEL_OFF    ' '
 #define CANVAS_PIXEL_ON     '*'
 
-#define BATCHES_COUNT 16
-
 CharWin cw_menu;
 CharWin cw_terminal;
 CharWin cw_canvas;
@@ -145,7 +158,8 @@ enum ApplicationState {
     AS_ACCURACY_CHECK,  // Network is checking its parameters
 	AS_DRAWING,		    // User is drawing a digit
 	AS_LOADING,		    // Loading parameters
-	AS_SAVING		    // Saving parameters
+	AS_SAVING,		    // Saving parameters
+	AS_FINETUNING	    // Network is training on user drawn digits
 };
 
 // Available input methods for handwritten digits
@@ -155,17 +169,27 @@ enum InputMode {
 } input_mode = LIGHT_PEN;
 
 // Current state of the application
+// Network parameters come first, so they start at the page boundary TheApplication is aligned to
 struct Application {
+    NeuralNetwork       neural_network;  // Our neural network parameters
 	ApplicationState	state;		     // Main application state
     uint8_t             epochs_left;     // Epochs to be processed
     uint8_t             batches_left;
-    NeuralNetwork       neural_network;  // Our neural network parameters
+    bool                background_training; // Training steps are run while the user draws
+    bool                binary_mode;     // Drawings are predicted by the binarized hidden layer
 }	TheApplication;
 
+#pragma align(TheApplication, 256)
+
 Training training;
 
+// Binarized hidden layer, built from current parameters when needed to compare it with the float one
+// It's taken from the arena at startup, see main()
+BinaryLayer *binary_layer;
+
 static const char * main_menu_texts[] = {
   "F1-TRAIN",
+  "F2-FINE-TUNE",
   "F3-SAVE PARAMS",
   "F5-LOAD PARAMS",
   "F7-DRAW DIGIT",
@@ -180,7 +204,9 @@ static const char * training_menu_texts[] = {
 static const char * drawing_menu_texts[] = {
   "F1-JOYSTICK",
   "F3-LIGHT PEN",
-  "F5-PREDICT"
+  "F5-PREDICT",
+  "F7-BACKGROUND TRAIN",
+  "F8-BINARY PREDICT"
 };
 
 /*
@@ -242,6 +268,143 @@ int load_bytes(const char *filename, uint8_t device, void *dest, int size)
     return result;
 }
 
+/*
+ * Saves hidden layer weights, one row of floats (one for every hidden neuron in use) for every network input
+ * Weights are kept in byte planes in memory, but the file format is still the original float array
+ */
+int save_weights_hidden(const char *filename, uint8_t device, NeuralNetwork *neural_network)
+{
+    int result = -1;
+    float row[HIDDEN_LAYER_SIZE];
+	krnio_setnam(filename);
+	if (krnio_open(2, (char)device, 2)) {
+        result = 0;
+        for(uint8_t i = 0; i < NETWORK_INPUT_SIZE; i++) {
+            get_weights_row(neural_network, i, row);
+            result += krnio_write(2, (char *)row, neural_network->hidden_count * sizeof(float));
+        }
+		krnio_close(2);
+	}
+    return result;
+}
+
+/*
+ * Loads hidden layer weights saved by save_weights_hidden(), hidden_count must be already set
+ * Files saved before the input mask existed hold a row for each of the 256 pixels (all_pixels):
+ * rows of the pixels left out by the mask are skipped, the others are the network inputs in the same order
+ */
+int load_weights_hidden(const char *filename, uint8_t device, NeuralNetwork *neural_network, bool all_pixels)
+{
+    int result = -1;
+    float row[HIDDEN_LAYER_SIZE];
+    uint16_t rows = all_pixels ? INPUT_LAYER_SIZE : NETWORK_INPUT_SIZE;
+	krnio_setnam(filename);
+	if (krnio_open(2, (char)device, 2)) {
+        result = 0;
+        uint8_t i = 0;
+        for(uint16_t r = 0; r < rows; r++) {
+            int read = krnio_read(2, (char *)row, neural_network->hidden_count * sizeof(float));
+            if (read != neural_network->hidden_count * sizeof(float)) break;
+            if (all_pixels && !(input_mask[r >> 3] & (0x80 >> (r & 7)))) continue;
+            set_weights_row(neural_network, i++, row);
+            result += read;
+        }
+		krnio_close(2);
+	}
+    return result;
+}
+
+/*
+ * Tells whether a file exists, checking the drive error channel after opening it
+ */
+bool file_exists(const char *filename, uint8_t device)
+{
+    char name[20];
+    char status[2] = {0, 0};
+    krnio_setnam("");
+    if (!krnio_open(15, (char)device, 15)) return false;
+    sprintf(name, "%s,U,R", filename);
+    krnio_setnam(name);
+    if (krnio_open(2, (char)device, 2)) {
+        krnio_read(15, status, 2);
+        krnio_close(2);
+    }
+    krnio_close(15);
+    // 00, OK
+    return status[0] == '0' && status[1] == '0';
+}
+
+/*
+ * Deletes a file, if it exists
+ */
+void scratch_file(const char *filename, uint8_t device)
+{
+    char command[20];
+    sprintf(command, "S0:%s", filename);
+    krnio_setnam(command);
+    if (krnio_open(15, (char)device, 15)) krnio_close(15);
+}
+
+/*
+ * Appends the parameters changed since last save or load to the journal, returns false in case of errors
+ * Every entry holds the number of changed hidden weights rows, then the network input index and the weights of
+ * every changed row (same layout of save_weights_hidden() rows), then the whole output layer and the biases
+ */
+bool save_journal(uint8_t device, NeuralNetwork *neural_network)
+{
+    bool result = false;
+    float row[HIDDEN_LAYER_SIZE];
+    uint8_t rows = dirty_rows_count(neural_network);
+    int row_size = neural_network->hidden_count * sizeof(float);
+    int expected = 1 + rows * (1 + row_size) + (neural_network->hidden_count * (OUTPUT_LAYER_SIZE + 1) + OUTPUT_LAYER_SIZE) * sizeof(float);
+	if (open_for_append(device, JOURNAL_FILENAME)) {
+        int written = krnio_write(2, (char *)&rows, 1);
+        for(uint8_t i = 0; i < NETWORK_INPUT_SIZE; i++) {
+            if (is_row_dirty(neural_network, i)) {
+                get_weights_row(neural_network, i, row);
+                written += krnio_write(2, (char *)&i, 1);
+                written += krnio_write(2, (char *)row, row_size);
+            }
+        }
+        written += krnio_write(2, (char *)neural_network->weights_output, neural_network->hidden_count * OUTPUT_LAYER_SIZE * sizeof(float));
+        written += krnio_write(2, (char *)neural_network->biases_hidden, row_size);
+        written += krnio_write(2, (char *)neural_network->biases_output, sizeof(neural_network->biases_output));
+        result = written == expected;
+        close_appended();
+	}
+    return result;
+}
+
+/*
+ * Replays the journal entries on top of the parameters just loaded, returns the number of entries applied
+ * A damaged entry (e.g. a save that didn't complete) stops the replay
+ */
+uint8_t load_journal(uint8_t device, NeuralNetwork *neural_network)
+{
+    uint8_t entries = 0;
+    float row[HIDDEN_LAYER_SIZE];
+    int row_size = neural_network->hidden_count * sizeof(float);
+	krnio_setnam(JOURNAL_FILENAME ",U,R");
+	if (krnio_open(2, (char)device, 2)) {
+        uint8_t rows;
+        while(krnio_read(2, (char *)&rows, 1) == 1) {
+            bool valid = true;
+            for(uint8_t r = 0; valid && r < rows; r++) {
+                uint8_t input;
+                valid = krnio_read(2, (char *)&input, 1) == 1 && input < NETWORK_INPUT_SIZE && krnio_read(2, (char *)row, row_size) == row_size;
+                if (valid) set_weights_row(neural_network, input, row);
+            }
+            valid = valid && krnio_read(2, (char *)neural_network->weights_output, neural_network->hidden_count * OUTPUT_LAYER_SIZE * sizeof(float)) == neural_network->hidden_count * OUTPUT_LAYER_SIZE * sizeof(float);
+            valid = valid && krnio_read(2, (char *)neural_network->biases_hidden, row_size) == row_size;
+            valid = valid && krnio_read(2, (char *)neural_network->biases_output, sizeof(neural_network->biases_output)) == sizeof(neural_network->biases_output);
+            if (!valid) break;
+            entries++;
+        }
+		krnio_close(2);
+	}
+    return entries;
+}
+
 /*
  * Scrolls up window and adds a new row of text
  */
@@ -294,42 +457,280 @@ void petscii_histogram(uint8_t x, uint8_t y, float values[], uint8_t num_values)
 
 
 /*
- * Main training loop, iterates over the input batches for the epochs number
- * Every batch is used for training and checked to compute overall network accuracy
+ * Reads dataset geometry and allocates batch memory, complaining if something's wrong
  */
-void train_loop(NeuralNetwork *neural_network, Training *training)
+bool prepare_dataset(Training *training)
 {
+    training->processed = 0;
+    if (load_dataset(DRIVE_NO, training)) return true;
+    window_log(&cw_terminal, "DATASET NOT USABLE");
+    return false;
+}
+
+/*
+ * Predicts the next records of the loaded batch, starting from record_index, up to max_count (at most PREDICT_BATCH_SIZE)
+ * Returns how many records were predicted, record_index is left for the caller to advance
+ */
+uint8_t predict_records(NeuralNetwork *neural_network, Training *training, uint8_t predictions[PREDICT_BATCH_SIZE], uint8_t max_count)
+{
+    uint16_t left = training->loaded_records - training->record_index;
+    uint8_t count = left < max_count ? left : max_count;
+    predict_batch(neural_network, training->batch + training->record_index, count, predictions);
+    return count;
+}
+
+/*
+ * Starts a new training session with a freshly initialized network, returns false if the dataset can't be used
+ */
+bool train_begin(NeuralNetwork *neural_network, Training *training)
+{
+    if (!prepare_dataset(training)) return false;
     init_training(training);
     init_network(neural_network);
-    while(!training->stopped && training->batch_index > -1) {
-        load_training_batch(DRIVE_NO, training);
-        while(!training->stopped && training->record_index < training->loaded_records) {
-            train(neural_network, training->batch[training->record_index], training->batch[training->record_index][BATCH_ROW_LENGTH - 1]);
+    training->phase = TP_LOADING;
+    return true;
+}
+
+/*
+ * Training is over, hidden neurons are going to be scored on every training batch
+ */
+void score_begin(Training *training)
+{
+    window_log(&cw_terminal, "SCORING HIDDEN NEURONS...");
+    init_hidden_stats(&training->hidden_stats);
+    training->scored_batches = 0;
+    training->phase = TP_LOADING_SCORES;
+}
+
+/*
+ * Removes the hidden neurons which barely affect the outputs, according to the scores collected
+ */
+void prune(NeuralNetwork *neural_network, Training *training)
+{
+    uint8_t removed = prune_hidden(neural_network, &training->hidden_stats);
+    sprintf(terminal_buf, "PRUNED %d, %d HIDDEN NEURONS LEFT", removed, neural_network->hidden_count);
+    window_log(&cw_terminal, terminal_buf);
+}
+
+/*
+ * Checks the next records of the validation batch (up to max_count) against current network, counting the correct guesses
+ */
+void validate_records(NeuralNetwork *neural_network, Training *training, uint8_t max_count)
+{
+    uint8_t predictions[PREDICT_BATCH_SIZE];
+    uint8_t count = predict_records(neural_network, training, predictions, max_count);
+    for(uint8_t k = 0; k < count; k++) {
+        training->validation_correct += training->batch[training->record_index][BATCH_ROW_LENGTH - 1] == predictions[k];
+        training->record_index++;
+    }
+}
+
+/*
+ * Feeds validation accuracy to the training schedule once the whole validation batch has been checked
+ * Returns false if training should stop
+ */
+bool check_schedule(Training *training)
+{
+    uint8_t accuracy = training->loaded_records ? (unsigned long)training->validation_correct * 100 / training->loaded_records : 0;
+    sprintf(terminal_buf, "VALIDATION=%d%% RATE=%.3f", accuracy, training->learning_rate);
+    window_log(&cw_terminal, terminal_buf);
+    switch (update_schedule(training, accuracy)) {
+    case SS_TARGET:
+        window_log(&cw_terminal, "TARGET ACCURACY REACHED");
+        return false;
+    case SS_PLATEAU:
+        window_log(&cw_terminal, "NO MORE PROGRESS, STOPPING");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Runs a single step of the training session: one training record, up to validation_records validation records,
+ * one record to score hidden neurons on or a batch load. Every few batches the network is checked against the
+ * validation batch: the learning rate is lowered when accuracy stalls and training stops early once it's good
+ * enough or doesn't improve anymore. Then hidden neurons are scored over every training batch and the ones
+ * which barely affect the outputs are pruned
+ * Returns false once the session is over, the network is never left halfway through an update
+ */
+bool train_step(NeuralNetwork *neural_network, Training *training, uint8_t validation_records)
+{
+    switch (training->phase) {
+    case TP_LOADING:
+        // Current batch is over, on to the next one
+        if (load_training_batch(DRIVE_NO, training)) {
+            training->phase = TP_TRAINING;
+        } else {
+            score_begin(training);
+        }
+        return true;
+    case TP_TRAINING:
+        if (training->record_index < training->loaded_records) {
+            train(neural_network, training->batch[training->record_index], training->batch[training->record_index][BATCH_ROW_LENGTH - 1], training->learning_rate);
+            training->processed++;
+            training->record_index++;
+        } else {
+            training->records_since_check += training->loaded_records;
+            training->phase = training->records_since_check >= VALIDATION_INTERVAL ? TP_LOADING_CHECK : TP_LOADING;
+        }
+        return true;
+    case TP_LOADING_CHECK:
+        load_batch(DRIVE_NO, training, validation_batch(training));
+        training->validation_correct = 0;
+        training->phase = TP_VALIDATING;
+        return true;
+    case TP_VALIDATING:
+        if (training->record_index < training->loaded_records) {
+            validate_records(neural_network, training, validation_records);
+            return true;
+        }
+        if (check_schedule(training)) {
+            training->phase = TP_LOADING;
+        } else {
+            score_begin(training);
+        }
+        return true;
+    case TP_LOADING_SCORES:
+        if (training->scored_batches < validation_batch(training)) {
+            load_batch(DRIVE_NO, training, training->scored_batches);
+            training->phase = TP_SCORING;
+            return true;
+        }
+        prune(neural_network, training);
+        break;
+    case TP_SCORING:
+        if (training->record_index < training->loaded_records) {
+            predict(neural_network, training->batch[training->record_index]);
+            collect_hidden_stats(neural_network, &training->hidden_stats);
+            training->record_index++;
+        } else {
+            training->scored_batches++;
+            training->phase = TP_LOADING_SCORES;
+        }
+        return true;
+    }
+    training->phase = TP_IDLE;
+    return false;
+}
+
+/*
+ * Main training loop, runs a whole training session from scratch
+ * Returns true once the session is over, false if it couldn't start or RUN/STOP interrupted it:
+ * in this case the session can still be resumed in background while drawing
+ */
+bool train_loop(NeuralNetwork *neural_network, Training *training)
+{
+    if (!train_begin(neural_network, training)) return false;
+    while(!training->stopped) {
+        if (!train_step(neural_network, training, PREDICT_BATCH_SIZE)) return true;
+    }
+    return false;
+}
+
+/*
+ * Trains the network on the replay buffer of user drawn digits, mixed with some dataset records
+ * Records are processed in random order, so replayed and dataset ones are interleaved
+ */
+void finetune_loop(NeuralNetwork *neural_network, Training *training)
+{
+    uint8_t order[FINETUNE_ROWS];
+    if (!prepare_dataset(training)) return;
+    init_training(training);
+    if (!load_finetune_batch(DRIVE_NO, training)) {
+        window_log(&cw_terminal, "NO SAMPLES TO LEARN FROM");
+        return;
+    }
+    for(uint8_t i = 0; i < training->loaded_records; i++) {
+        order[i] = i;
+    }
+    shuffle_array(order, training->loaded_records);
+    for(uint8_t i = 0; !training->stopped && i < training->loaded_records; i++) {
+        training->record_index = order[i];
+        train(neural_network, training->batch[training->record_index], training->batch[training->record_index][BATCH_ROW_LENGTH - 1], FINETUNE_LEARNING_RATE);
+        training->processed++;
+    }
+}
+
+/*
+ * Checks every record of the loaded batch against current network, updating correct and processed counters
+ */
+void evaluate_batch(NeuralNetwork *neural_network, Training *training)
+{
+    while(!training->stopped && training->record_index < training->loaded_records) {
+        uint8_t predictions[PREDICT_BATCH_SIZE];
+        uint8_t count = predict_records(neural_network, training, predictions, PREDICT_BATCH_SIZE);
+        for(uint8_t k = 0; k < count; k++) {
+            training->correct += training->batch[training->record_index][BATCH_ROW_LENGTH - 1] == predictions[k];
             training->processed++;
             training->record_index++;
         }
-        training->batch_index--;
     }
 }
 
+/*
+ * Checks every record of the loaded batch against the binarized network, returns the number of correct guesses
+ * binary_layer must be up to date with network parameters
+ */
+uint16_t evaluate_batch_binary(NeuralNetwork *neural_network, Training *training)
+{
+    uint16_t correct = 0;
+    for(uint16_t r = 0; !training->stopped && r < training->loaded_records; r++) {
+        correct += training->batch[r][BATCH_ROW_LENGTH - 1] == predict_binary(neural_network, binary_layer, training->batch[r]);
+    }
+    return correct;
+}
+
 /*
  * Takes a random batch and checks every record against current network
  * to verify current accuracy
  */
 void accuracy_loop(NeuralNetwork *neural_network, Training *training)
 {
+    if (!prepare_dataset(training)) return;
     init_training(training);
     load_training_batch(DRIVE_NO, training);
-    while(!training->stopped && training->record_index < training->loaded_records) {
-        uint8_t guessed_digit  = predict(neural_network, training->batch[training->record_index]);
-        training->correct += training->batch[training->record_index][BATCH_ROW_LENGTH - 1] == guessed_digit;
-        training->processed++;
-        training->record_index++;
+    evaluate_batch(neural_network, training);
+}
+
+/*
+ * Runs a training step if background training is on, returns false if there was nothing to do
+ * Steps never leave the network halfway through an update, so predictions between them are consistent
+ */
+bool background_step(NeuralNetwork *neural_network)
+{
+    if (!TheApplication.background_training) return false;
+    // One validation record at a time, steps have to be short enough not to get in the user's way
+    if (!train_step(neural_network, &training, 1)) {
+        TheApplication.background_training = false;
+        window_log(&cw_terminal, "BACKGROUND TRAINING DONE");
     }
+    return true;
+}
+
+/*
+ * Turns background training on or off, a new session is started when none can be resumed
+ */
+void toggle_background_training(NeuralNetwork *neural_network)
+{
+    if (TheApplication.background_training) {
+        TheApplication.background_training = false;
+        window_log(&cw_terminal, "BACKGROUND TRAINING PAUSED");
+        return;
+    }
+    if (training.phase == TP_IDLE) {
+        if (!confirm(&cw_terminal, "TRAIN FROM SCRATCH? (Y/N)") || !train_begin(neural_network, &training)) return;
+    } else if (!confirm(&cw_terminal, "RESUME TRAINING? (Y/N)")) {
+        // A session interrupted with RUN/STOP is only continued on request
+        return;
+    }
+    training.stopped = false;
+    TheApplication.background_training = true;
+    window_log(&cw_terminal, "TRAINING IN BACKGROUND");
 }
 
 /*
  * Converts canvas handwritten data to a byte array
+ * Pixels not connected to the network are cleared, so the displayed digit matches what is being evaluated
  */
 void canvas_to_input(CharWin * win, input_t input)
 {
@@ -341,7 +742,7 @@ void canvas_to_input(CharWin * win, input_t input)
                 byte_value |= 1 << (7 - (i & 7));
             }
             if ((i & 7) == 7) {
-                input[i >> 3] = byte_value;
+                input[i >> 3] = byte_value & input_mask[i >> 3];
                 byte_value = 0;
             }            
         }
@@ -389,12 +790,15 @@ void draw_and_predict(NeuralNetwork *neural_network)
     do {
         bool moved = false;
         bool toggled = false;
+        // Training steps only run when the user isn't doing anything
+        bool idle = true;
         if (input_mode == JOYSTICK) {
             joy_poll(0);
             cw_canvas.cx = CLAMP((signed char)cw_canvas.cx + joyx[0], 0, cw_canvas.wx - 1);
             cw_canvas.cy = CLAMP((signed char)cw_canvas.cy + joyy[0], 0, cw_canvas.wy - 1);
             moved = true;
             toggled = (bool)joyb[0];
+            idle = !joyx[0] && !joyy[0] && !toggled;
         } else if (input_mode == LIGHT_PEN) {
             // Read light pen position, convert it to screen coordinates and then to canvas coordinates
             // X position has to be multiplied by two, since its value was halved in order to be stored in a byte
@@ -409,6 +813,7 @@ void draw_and_predict(NeuralNetwork *neural_network)
                 moved = true;
             }
             toggled = moved;         
+            idle = !moved;
         }
         if (moved) {
             spr_move(1, ((cw_canvas.cx + cw_canvas.sx) << 3) + 24, ((cw_canvas.cy + cw_canvas.sy) << 3) + 50);            
@@ -418,6 +823,7 @@ void draw_and_predict(NeuralNetwork *neural_network)
             }
         }
         if (kbhit()) {
+            idle = false;
             char c = getch();
             switch (c) {
             case PETSCII_F1:
@@ -431,18 +837,37 @@ void draw_and_predict(NeuralNetwork *neural_network)
             case PETSCII_F5:
                 done = confirm(&cw_terminal, "EXIT DRAWING? (Y/N)");
                 break;
+            case PETSCII_F7:
+                toggle_background_training(neural_network);
+                break;
+            case PETSCII_F8:
+                TheApplication.binary_mode = !TheApplication.binary_mode;
+                window_log(&cw_terminal, TheApplication.binary_mode ? "BINARY MODE ON" : "BINARY MODE OFF");
+                break;
             }
         }
-        // Loop is too fast, wait a few frames
-        vic_waitFrames(5);
+        // Loop is too fast: the time a training step takes is enough, otherwise wait a few frames
+        if (!idle || !background_step(neural_network)) vic_waitFrames(5);
     } while (!done);
     spr_show(1, false);
+    if (TheApplication.background_training) {
+        // The session can be resumed next time, as long as the batch isn't used for something else meanwhile
+        TheApplication.background_training = false;
+        window_log(&cw_terminal, "BACKGROUND TRAINING PAUSED");
+    }
 
     // Prediction and result display
     canvas_to_input(&cw_canvas, current_input);
     draw_digit(current_input);
     spr_show(0, true);
-    uint8_t predicted = predict(neural_network, current_input);
+    uint8_t predicted;
+    if (TheApplication.binary_mode) {
+        // Built now, so it reflects every adjustment made since the last prediction
+        binarize_hidden(neural_network, binary_layer);
+        predicted = predict_binary(neural_network, binary_layer, current_input);
+    } else {
+        predicted = predict(neural_network, current_input);
+    }
     petscii_histogram(19, 2, neural_network->activations_hidden, HIDDEN_LAYER_SIZE);
     petscii_histogram(19, 4, neural_network->activations_output, OUTPUT_LAYER_SIZE);
     display_char(predicted);
@@ -460,7 +885,12 @@ void draw_and_predict(NeuralNetwork *neural_network)
         } while (!is_number);
     }
     window_log(&cw_terminal, "ADJUSTING WEIGHTS...");
-    train(neural_network, current_input, predicted);
+    train(neural_network, current_input, predicted, LEARNING_RATE);
+
+    // Keep the sample for later fine-tuning sessions
+    if (!append_replay_record(DRIVE_NO, current_input, predicted)) {
+        window_log(&cw_terminal, "COULD NOT SAVE SAMPLE");
+    }
     spr_show(0, false);
 }
 
@@ -486,23 +916,69 @@ void application_state(ApplicationState state)
         spr_show(0, false);            
         application_state(AS_READY);
         break;
+    case AS_FINETUNING:
+        display_menu(&cw_menu, training_menu_texts, ARRAY_SIZE(training_menu_texts));
+        window_log(&cw_terminal, "FINE-TUNING ON YOUR DIGITS...");
+        spr_show(0, true);
+        finetune_loop(&TheApplication.neural_network, &training);
+        spr_show(0, false);
+        sprintf(terminal_buf, "...DONE, %d RECORDS", training.processed);
+        window_log(&cw_terminal, terminal_buf);
+        application_state(AS_READY);
+        break;
     case AS_ACCURACY_CHECK:
         spr_show(0, true);
         accuracy_loop(&TheApplication.neural_network, &training);
         spr_show(0, false);
-        sprintf(terminal_buf, "ACCURACY=%.2f%%", ((float)training.correct / training.processed) * 100.0);
-        window_log(&cw_terminal, terminal_buf);
+        if (training.processed) {
+            sprintf(terminal_buf, "ACCURACY=%.2f%%", ((float)training.correct / training.processed) * 100.0);
+            window_log(&cw_terminal, terminal_buf);
+            // Same batch again with the binarized hidden layer, for comparison
+            binarize_hidden(&TheApplication.neural_network, binary_layer);
+            uint16_t correct = evaluate_batch_binary(&TheApplication.neural_network, &training);
+            if (!training.stopped) {
+                sprintf(terminal_buf, "BINARY ACCURACY=%.2f%%", ((float)correct / training.loaded_records) * 100.0);
+                window_log(&cw_terminal, terminal_buf);
+            }
+        }
         application_state(AS_READY);
         break;
 	case AS_SAVING:
         cwin_fill_rect(&cw_menu, 0, 0, cw_menu.wx, cw_menu.wy, ' ', MENU_COLOR);
         if (confirm(&cw_terminal, "SAVE PARAMETERS? (Y/N)")) {
-            window_log(&cw_terminal, "SAVING...");
-            save_bytes("@0:WH,U,W", DRIVE_NO, TheApplication.neural_network.weights_hidden, sizeof(TheApplication.neural_network.weights_hidden));
-            save_bytes("@0:WO,U,W", DRIVE_NO, TheApplication.neural_network.weights_output, sizeof(TheApplication.neural_network.weights_output));
-            save_bytes("@0:BH,U,W", DRIVE_NO, TheApplication.neural_network.biases_hidden, sizeof(TheApplication.neural_network.biases_hidden));
-            save_bytes("@0:BO,U,W", DRIVE_NO, TheApplication.neural_network.biases_output, sizeof(TheApplication.neural_network.biases_output));
-            window_log(&cw_terminal, "...DONE");
+            NeuralNetwork *neural_network = &TheApplication.neural_network;
+            // After a few corrections only some weights rows changed, they can be appended to the journal
+            // Otherwise (or when asked to) parameters are saved in full, which also compacts the journal
+            if (!neural_network->dirty_all && dirty_rows_count(neural_network) <= JOURNAL_ROWS_MAX && confirm(&cw_terminal, "SAVE CHANGES ONLY? (Y/N)")) {
+                sprintf(terminal_buf, "SAVING %d CHANGED ROWS...", dirty_rows_count(neural_network));
+                window_log(&cw_terminal, terminal_buf);
+                if (save_journal(DRIVE_NO, neural_network)) {
+                    set_dirty(neural_network, false);
+                    window_log(&cw_terminal, "...DONE");
+                } else {
+                    window_log(&cw_terminal, "COULD NOT SAVE CHANGES");
+                }
+            } else {
+                window_log(&cw_terminal, "SAVING...");
+                // The journal holds changes to the old model files, it must not be replayed over the new ones,
+                // not even when the save is interrupted halfway
+                scratch_file(JOURNAL_FILENAME, DRIVE_NO);
+                int row_size = neural_network->hidden_count * sizeof(float);
+                bool saved = save_bytes("@0:IM,U,W", DRIVE_NO, (void *)input_mask, sizeof(input_mask)) == sizeof(input_mask);
+                // Pruned neurons are left out, the hidden layer size is implied by the BH file length
+                saved = saved && save_weights_hidden("@0:WH,U,W", DRIVE_NO, neural_network) == NETWORK_INPUT_SIZE * row_size;
+                saved = saved && save_bytes("@0:WO,U,W", DRIVE_NO, neural_network->weights_output, row_size * OUTPUT_LAYER_SIZE) == row_size * OUTPUT_LAYER_SIZE;
+                saved = saved && save_bytes("@0:BH,U,W", DRIVE_NO, neural_network->biases_hidden, row_size) == row_size;
+                saved = saved && save_bytes("@0:BO,U,W", DRIVE_NO, neural_network->biases_output, sizeof(neural_network->biases_output)) == sizeof(neural_network->biases_output);
+                if (saved) {
+                    set_dirty(neural_network, false);
+                    window_log(&cw_terminal, "...DONE");
+                } else {
+                    // Model files may be half written, only a full save can fix them
+                    set_dirty(neural_network, true);
+                    window_log(&cw_terminal, "COULD NOT SAVE");
+                }
+            }
         }
         application_state(AS_READY);
         break;
@@ -510,11 +986,37 @@ void application_state(ApplicationState state)
         cwin_fill_rect(&cw_menu, 0, 0, cw_menu.wx, cw_menu.wy, ' ', MENU_COLOR);
         if (confirm(&cw_terminal, "LOAD PARAMETERS? (Y/N)")) {
             window_log(&cw_terminal, "LOADING...");
-            load_bytes("WH,U,R", DRIVE_NO, TheApplication.neural_network.weights_hidden, sizeof(TheApplication.neural_network.weights_hidden));
-            load_bytes("WO,U,R", DRIVE_NO, TheApplication.neural_network.weights_output, sizeof(TheApplication.neural_network.weights_output));
-            load_bytes("BH,U,R", DRIVE_NO, TheApplication.neural_network.biases_hidden, sizeof(TheApplication.neural_network.biases_hidden));
-            load_bytes("BO,U,R", DRIVE_NO, TheApplication.neural_network.biases_output, sizeof(TheApplication.neural_network.biases_output));
-            window_log(&cw_terminal, "...DONE");
+            // Weights are only meaningful for the input mapping they were trained with
+            // Models without a mask were trained on every pixel, the rows of the masked ones can still be used
+            bool masked = file_exists("IM", DRIVE_NO);
+            uint8_t saved_mask[sizeof(input_mask)];
+            if (masked && (load_bytes("IM,U,R", DRIVE_NO, saved_mask, sizeof(saved_mask)) != sizeof(saved_mask) || memcmp(saved_mask, input_mask, sizeof(input_mask)))) {
+                window_log(&cw_terminal, "INPUT MASK MISMATCH");
+            } else {
+                // One hidden bias per neuron, the model may have been pruned
+                int biases = load_bytes("BH,U,R", DRIVE_NO, TheApplication.neural_network.biases_hidden, sizeof(TheApplication.neural_network.biases_hidden));
+                if (biases < (int)sizeof(float) || biases % sizeof(float)) {
+                    window_log(&cw_terminal, "HIDDEN BIASES MISSING");
+                } else {
+                    TheApplication.neural_network.hidden_count = biases / sizeof(float);
+                    if (!masked) window_log(&cw_terminal, "NO INPUT MASK, DROPPING PIXELS");
+                    load_weights_hidden("WH,U,R", DRIVE_NO, &TheApplication.neural_network, !masked);
+                    load_bytes("WO,U,R", DRIVE_NO, TheApplication.neural_network.weights_output, TheApplication.neural_network.hidden_count * OUTPUT_LAYER_SIZE * sizeof(float));
+                    load_bytes("BO,U,R", DRIVE_NO, TheApplication.neural_network.biases_output, sizeof(TheApplication.neural_network.biases_output));
+                    for(uint8_t h = TheApplication.neural_network.hidden_count; h < HIDDEN_LAYER_SIZE; h++) {
+                        TheApplication.neural_network.activations_hidden[h] = 0.0;
+                    }
+                    // Changes saved after the model files come on top of them
+                    uint8_t entries = load_journal(DRIVE_NO, &TheApplication.neural_network);
+                    // Remapped weights no longer match the files they came from, only a full save will do
+                    set_dirty(&TheApplication.neural_network, !masked);
+                    // A paused session must not resume on top of the loaded model
+                    training.phase = TP_IDLE;
+                    TheApplication.background_training = false;
+                    sprintf(terminal_buf, "...DONE, %d HIDDEN, %d CHANGES", TheApplication.neural_network.hidden_count, entries);
+                    window_log(&cw_terminal, terminal_buf);
+                }
+            }
         }
         application_state(AS_READY);
         break;
@@ -539,6 +1041,9 @@ void main_loop()
             switch (ch) {
 	            case PETSCII_F1:
                 application_state(AS_TRAINING);
+                break;
+	            case PETSCII_F2:
+                application_state(AS_FINETUNING);
                 break;
 	            case PETSCII_F3:
                 application_state(AS_SAVING);
@@ -572,6 +1077,7 @@ __interrupt void frame_irq(void)
     static uint16_t last_processed = UINT16_MAX; // Keep track of last processed batch item 
 	switch (TheApplication.state) {
         case AS_TRAINING:
+        case AS_FINETUNING:
         case AS_ACCURACY_CHECK:
             // We're training the network or verifying its accuracy, if RUN/STOP is pressed flag "stopped" in Training structure is set
             // While looping the flag is checked at every step, if it's set the loop is interrupted (pun not intended)
@@ -583,7 +1089,7 @@ __interrupt void frame_irq(void)
 
             // Draw currently processed digit and display some info,
             // but only if it changed since last frame
-            if (training.processed != last_processed) {
+            if (training.batch && training.processed != last_processed) {
                 draw_digit(training.batch[training.record_index]);
 
                 itoa(training.batch_index, raster_buf, 10);
@@ -599,11 +1105,83 @@ __interrupt void frame_irq(void)
     vic.color_border--;
 }
 
+#ifdef BENCHMARK
+/*
+ * Headless benchmark: trains with the fixed seed, evaluates the whole dataset,
+ * saves phase timings (in jiffies) to disk and quits the emulator
+ */
+void benchmark(void)
+{
+    char results[128];
+    uint32_t start, train_jiffies, train_load_jiffies, eval_jiffies, eval_load_jiffies, binary_jiffies;
+    uint16_t trained, binary_correct = 0;
+
+    window_log(&cw_terminal, "BENCHMARK: TRAINING...");
+    TheApplication.state = AS_TRAINING;
+    benchmark_load_jiffies = 0;
+    start = jiffies();
+    train_loop(&TheApplication.neural_network, &training);
+    train_jiffies = jiffies() - start;
+    train_load_jiffies = benchmark_load_jiffies;
+    trained = training.processed;
+
+    window_log(&cw_terminal, "BENCHMARK: EVALUATING...");
+    TheApplication.state = AS_ACCURACY_CHECK;
+    benchmark_load_jiffies = 0;
+    start = jiffies();
+    if (prepare_dataset(&training)) {
+        init_training(&training);
+        for(uint8_t b = 0; b < training.dataset.batch_count; b++) {
+            load_batch(DRIVE_NO, &training, b);
+            evaluate_batch(&TheApplication.neural_network, &training);
+        }
+    }
+    eval_jiffies = jiffies() - start;
+    eval_load_jiffies = benchmark_load_jiffies;
+
+    // Same evaluation with the binarized hidden layer, building it is part of the cost
+    window_log(&cw_terminal, "BENCHMARK: BINARY EVALUATION...");
+    benchmark_load_jiffies = 0;
+    start = jiffies();
+    if (training.batch) {
+        binarize_hidden(&TheApplication.neural_network, binary_layer);
+        for(uint8_t b = 0; b < training.dataset.batch_count; b++) {
+            load_batch(DRIVE_NO, &training, b);
+            binary_correct += evaluate_batch_binary(&TheApplication.neural_network, &training);
+        }
+    }
+    binary_jiffies = jiffies() - start;
+
+    // One phase per line: name, total jiffies, jiffies spent loading batches, records, correct guesses
+    sprintf(results, "TRAIN %ld %ld %u 0\nEVAL %ld %ld %u %u\nBINARY %ld %ld %u %u\n",
+        (long)train_jiffies, (long)train_load_jiffies, trained,
+        (long)eval_jiffies, (long)eval_load_jiffies, training.processed, training.correct,
+        (long)binary_jiffies, (long)benchmark_load_jiffies, training.processed, binary_correct);
+    save_bytes("@0:" BENCHMARK_FILENAME ",S,W", DRIVE_NO, results, strlen(results));
+
+    // Reading the error channel makes sure the drive is done writing before we quit
+    char status[2];
+    krnio_setnam("");
+    if (krnio_open(15, DRIVE_NO, 15)) {
+        krnio_read(15, status, sizeof(status));
+        krnio_close(15);
+    }
+    window_log(&cw_terminal, "BENCHMARK: DONE");
+    *DEBUG_CART_EXIT = 0;
+    TheApplication.state = AS_READY;
+}
+#endif
+
 int main(void)
 {
     // Fixed random seed to simplify debugging
     srand(74);
 
+    // Network starts with the whole hidden layer, until it gets trained and pruned
+    TheApplication.neural_network.hidden_count = HIDDEN_LAYER_SIZE;
+    // Nothing has been saved yet, the first save has to be a full one
+    set_dirty(&TheApplication.neural_network, true);
+
     // Install trampoline
     mmap_trampoline();
 	
@@ -635,6 +1213,12 @@ int main(void)
     spr_set(0, false, 304, 58, (unsigned)Sprite0 / 64, VCOL_LT_GREEN, false, true, true);
     spr_set(1, false, 8 + 24, 58, ((unsigned)Sprite0 / 64) + 1, VCOL_LT_RED, false, false, false);
 
+    // Charset, background and sprites have been copied where they're needed, their memory can hold buffers now
+    // The gap between sprites and screen comes first, so the binary layer fits there and leaves the larger block to the batch
+    arena_add(ArenaGap, Screen - ArenaGap);
+    arena_add(ArenaStart, Sprite0 - ArenaStart);
+    binary_layer = (BinaryLayer *)arena_alloc(sizeof(BinaryLayer));
+
     // Windows initialization
     cwin_init(&cw_terminal, Screen, TERMINAL_LEFT, TERMINAL_TOP, TERMINAL_WIDTH, TERMINAL_HEIGHT);
     cwin_init(&cw_menu, Screen, MENU_LEFT, MENU_TOP, MENU_WIDTH, MENU_HEIGHT);
@@ -657,6 +1241,9 @@ int main(void)
 	rirq_start();
 
 
+#ifdef BENCHMARK
+    benchmark();
+#endif
 
     for(;;) {
         main_loop();
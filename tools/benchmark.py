@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""
+End-to-end benchmark of PETSCII-Boy 3000 Mark-II under VICE
+
+Builds the headless benchmark program (petsciiboy.c with BENCHMARK defined),
+puts it on a fresh disk image with the dataset, runs it in x64sc with warp
+mode and true drive emulation, then reads back the RESULTS file written by
+the C64 and prints the timing of every phase: training, evaluation of the
+whole dataset and the same evaluation with the binarized hidden layer.
+
+The program quits the emulator through the VICE debug cartridge once done,
+so the whole run needs no interaction. Timings are measured by the C64
+itself in jiffies, so they don't depend on the host speed or on warp mode.
+
+Usage: tools/benchmark.py [--build DIR] [--timeout SECONDS]
+
+Tools are looked up in PATH, OSCAR64, X64SC and C1541 environment variables
+override them.
+"""
+
+import argparse
+import glob
+import os
+import subprocess
+import sys
+
+JIFFIES_PER_SECOND = 60
+
+
+def run(command, **kwargs):
+    print("$ " + " ".join(command), file=sys.stderr)
+    return subprocess.run(command, check=True, **kwargs)
+
+
+def main():
+    root = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--build", default=os.path.join(root, "build", "benchmark"))
+    parser.add_argument("--timeout", type=int, default=4 * 3600, help="emulator time limit in seconds")
+    args = parser.parse_args()
+
+    oscar64 = os.environ.get("OSCAR64", "oscar64")
+    x64sc = os.environ.get("X64SC", "x64sc")
+    c1541 = os.environ.get("C1541", "c1541")
+
+    os.makedirs(args.build, exist_ok=True)
+    prg = os.path.join(args.build, "benchmark.prg")
+    d64 = os.path.join(args.build, "benchmark.d64")
+    results = os.path.join(args.build, "results.txt")
+
+    run([oscar64, "-n", "-O2", "-dBENCHMARK", "-o=" + prg, os.path.join(root, "src", "petsciiboy.c")])
+
+    disk = [c1541, "-format", "benchmark,pb", "d64", d64, "-write", prg, "petsciiboy"]
+    for path in sorted(glob.glob(os.path.join(root, "resources", "*.usr"))):
+        name = os.path.splitext(os.path.basename(path))[0]
+        disk += ["-write", path, name + ",u"]
+    run(disk)
+
+    # Quitting through the debug cartridge gives exit code 0, a timeout means something went wrong
+    run([x64sc, "-console", "-warp", "-debugcart", "-limitcycles", str(args.timeout * 985248),
+         "-drive8type", "1541", "-drive8truedrive", "-8", d64, "-autostart", d64])
+
+    if os.path.exists(results):
+        os.remove(results)
+    run([c1541, d64, "-read", "results", results])
+
+    with open(results, "rb") as f:
+        lines = f.read().replace(b"\r", b"\n").decode("ascii", "replace").split("\n")
+
+    for line in filter(None, (l.strip() for l in lines)):
+        name, total, load, records, correct = line.split()
+        total, load, records, correct = int(total), int(load), int(records), int(correct)
+        print("%-6s %8.1f s total, %8.1f s loading, %8.1f s computing, %5d records" % (
+            name.lower(), total / JIFFIES_PER_SECOND, load / JIFFIES_PER_SECOND,
+            (total - load) / JIFFIES_PER_SECOND, records), end="")
+        if name != "TRAIN" and records:
+            print(", accuracy %.2f%%" % (100.0 * correct / records), end="")
+        print()
+
+
+if __name__ == "__main__":
+    main()
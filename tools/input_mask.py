@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""
+Input pixel pruning analysis for PETSCII-Boy 3000 Mark-II
+
+Reads the bit-packed training batches (resources/neural*.usr), scores every
+one of the 256 input pixels by the mutual information it shares with the
+digit label and keeps only the most informative ones.
+
+The result is emitted as a pair of C sources (src/inputmask.h, src/inputmask.c)
+holding a remap table from network input index to pixel index and a 32 byte
+mask with the same layout as input_t. The C64 network is then built on the
+reduced input vector, so every dropped pixel saves HIDDEN_LAYER_SIZE floats
+in weights_hidden and a step in the predict/train input loops.
+
+Usage: tools/input_mask.py [--keep N] [--resources DIR] [--output DIR]
+"""
+
+import argparse
+import math
+import os
+
+# Batches may be run length coded, rechunk.py knows how to read them
+from rechunk import RECORD_LENGTH, load_records
+
+PIXELS = 256
+DIGITS = 10
+
+
+def pixel(record, i):
+    return record[i >> 3] >> (7 - (i & 7)) & 1
+
+
+def mutual_information(records):
+    """Returns I(pixel; label) in bits for every pixel"""
+    total = len(records)
+    scores = []
+    for i in range(PIXELS):
+        joint = [[0] * DIGITS for _ in range(2)]
+        for record in records:
+            joint[pixel(record, i)][record[RECORD_LENGTH - 1]] += 1
+        score = 0.0
+        for bit in range(2):
+            p_bit = sum(joint[bit]) / total
+            for digit in range(DIGITS):
+                p_digit = (joint[0][digit] + joint[1][digit]) / total
+                p = joint[bit][digit] / total
+                if p > 0:
+                    score += p * math.log2(p / (p_bit * p_digit))
+        scores.append(score)
+    return scores
+
+
+def write_sources(output, kept, keep):
+    mask = [0] * (PIXELS // 8)
+    for i in kept:
+        mask[i >> 3] |= 1 << (7 - (i & 7))
+
+    with open(os.path.join(output, "inputmask.h"), "w") as f:
+        f.write("#ifndef PB_INPUT_MASK_H\n")
+        f.write("#define PB_INPUT_MASK_H\n\n")
+        f.write("#include <stdint.h>\n\n")
+        f.write("// Generated by tools/input_mask.py, do not edit\n\n")
+        f.write("// Number of pixels actually fed to the network\n")
+        f.write("#define INPUT_MAPPED_SIZE %d\n\n" % keep)
+        f.write("// Pixel index (0-255) of every network input\n")
+        f.write("extern const uint8_t input_map[INPUT_MAPPED_SIZE];\n\n")
+        f.write("// Kept pixels as a bit mask, same layout as input_t\n")
+        f.write("extern const uint8_t input_mask[%d];\n\n" % len(mask))
+        f.write('#pragma compile("inputmask.c")\n\n')
+        f.write("#endif\n")
+
+    with open(os.path.join(output, "inputmask.c"), "w") as f:
+        f.write('#include "inputmask.h"\n\n')
+        f.write("// Generated by tools/input_mask.py, do not edit\n\n")
+        f.write("const uint8_t input_map[INPUT_MAPPED_SIZE] = {\n")
+        for row in range(0, keep, 16):
+            f.write("    " + ", ".join("%3d" % i for i in kept[row:row + 16]) + ",\n")
+        f.write("};\n\n")
+        f.write("const uint8_t input_mask[%d] = {\n" % len(mask))
+        for row in range(0, len(mask), 8):
+            f.write("    " + ", ".join("0x%02x" % m for m in mask[row:row + 8]) + ",\n")
+        f.write("};\n")
+
+
+def main():
+    root = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--keep", type=int, default=192, help="number of pixels to keep (default 192)")
+    parser.add_argument("--resources", default=os.path.join(root, "resources"))
+    parser.add_argument("--output", default=os.path.join(root, "src"))
+    args = parser.parse_args()
+
+    # Network inputs are walked with an 8 bit index on the C64
+    if not 1 <= args.keep < PIXELS:
+        parser.error("--keep must be in 1-%d range" % (PIXELS - 1))
+
+    records = load_records(args.resources)
+    scores = mutual_information(records)
+
+    # Keep the most informative pixels, but store them in raster order
+    # so the network still walks the input bit stream front to back
+    ranked = sorted(range(PIXELS), key=lambda i: scores[i], reverse=True)
+    kept = sorted(ranked[:args.keep])
+    write_sources(args.output, kept, args.keep)
+
+    for y in range(16):
+        print("".join("#" if y * 16 + x in kept else "." for x in range(16)))
+    print("%d records, %d/%d pixels kept, weights_hidden shrinks by %d bytes" % (
+        len(records), args.keep, PIXELS, (PIXELS - args.keep) * 14 * 4))
+
+
+if __name__ == "__main__":
+    main()
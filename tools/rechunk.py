@@ -0,0 +1,168 @@
+#!/usr/bin/env python3
+"""
+Re-chunks the PETSCII-Boy 3000 Mark-II training dataset
+
+Reads all the bit-packed records (33 bytes each) from the batch files
+(neural00.usr, neural01.usr, ...) and writes them again in batches of the
+requested size, along with the dataset.usr header describing the geometry:
+
+    byte 0      header version (2)
+    byte 1      record length
+    bytes 2-3   records per batch, little endian
+    byte 4      batch count
+    bytes 5-6   total records, little endian
+    byte 7      batch encoding: 0 raw records, 1 run length coded
+
+The C64 reads the header and sizes its batch buffer accordingly, so larger
+batches mean fewer file opens per epoch. The buffer comes from the memory
+reclaimed after startup, which holds up to 128 records.
+The last batch is reserved for validation.
+
+Unless --raw is given batches are run length coded, which takes about 30%
+less disk space and transfer time. Records are expanded by the C64 while
+they're loaded. Every record is a sequence of nibbles (high nibble first),
+starting on a byte boundary and padded with a zero nibble when needed:
+
+    label (0-9)
+    lengths of alternating runs of unlit and lit pixels, starting with an
+    unlit one (which may be empty) and covering all the 256 pixels; a
+    nibble of 15 adds 15 pixels to the run and tells another nibble follows
+
+Digits are made of strokes, so runs of lit pixels are short and a row
+usually holds one or two of them: most runs fit in a single nibble.
+
+Usage: tools/rechunk.py --records N [--raw] [--resources DIR] [--output DIR]
+"""
+
+import argparse
+import glob
+import os
+import struct
+
+RECORD_LENGTH = 33
+PIXELS = (RECORD_LENGTH - 1) * 8
+HEADER_VERSION = 2
+BATCH_COUNT_MAX = 255
+RECORDS_PER_BATCH_MAX = 128
+ENCODING_RAW = 0
+ENCODING_RUN_LENGTH = 1
+
+
+def batch_files(directory):
+    return sorted(glob.glob(os.path.join(directory, "neural[0-9a-f][0-9a-f].usr")))
+
+
+def pixels(record):
+    return [(record[i >> 3] >> (7 - (i & 7))) & 1 for i in range(PIXELS)]
+
+
+def encode_record(record):
+    if record[-1] > 9:
+        raise ValueError("label %d out of range" % record[-1])
+    nibbles = [record[-1]]
+    lit, run = 0, 0
+    for pixel in pixels(record) + [None]:
+        if pixel == lit:
+            run += 1
+            continue
+        while run >= 15:
+            nibbles.append(15)
+            run -= 15
+        nibbles.append(run)
+        lit, run = pixel, 1
+    if len(nibbles) & 1:
+        nibbles.append(0)
+    return bytes(nibbles[i] << 4 | nibbles[i + 1] for i in range(0, len(nibbles), 2))
+
+
+def decode_records(data):
+    nibbles = [n for byte in data for n in (byte >> 4, byte & 15)]
+    records, position = [], 0
+    while position < len(nibbles):
+        record = bytearray(RECORD_LENGTH)
+        record[-1] = nibbles[position]
+        position += 1
+        pixel, lit = 0, False
+        while pixel < PIXELS:
+            run = 0
+            while True:
+                run += nibbles[position]
+                position += 1
+                if nibbles[position - 1] != 15:
+                    break
+            if lit:
+                for i in range(pixel, pixel + run):
+                    record[i >> 3] |= 0x80 >> (i & 7)
+            pixel += run
+            lit = not lit
+        if pixel != PIXELS:
+            raise ValueError("damaged record")
+        records.append(bytes(record))
+        position += position & 1
+    return records
+
+
+def dataset_encoding(directory):
+    path = os.path.join(directory, "dataset.usr")
+    # Disks without a header predate run length coding, the C64 reads them as raw too
+    if not os.path.exists(path):
+        return ENCODING_RAW
+    with open(path, "rb") as f:
+        header = f.read()
+    return header[7] if header[0] == HEADER_VERSION else ENCODING_RAW
+
+
+def load_records(resources):
+    records = []
+    encoding = dataset_encoding(resources)
+    for path in batch_files(resources):
+        with open(path, "rb") as f:
+            data = f.read()
+        if encoding == ENCODING_RUN_LENGTH:
+            records += decode_records(data)
+            continue
+        for offset in range(0, len(data) - RECORD_LENGTH + 1, RECORD_LENGTH):
+            records.append(data[offset:offset + RECORD_LENGTH])
+    return records
+
+
+def main():
+    root = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--records", type=int, required=True, help="records per batch")
+    parser.add_argument("--raw", action="store_true", help="don't run length code the batches")
+    parser.add_argument("--resources", default=os.path.join(root, "resources"))
+    parser.add_argument("--output", default=os.path.join(root, "resources"))
+    args = parser.parse_args()
+
+    records = load_records(args.resources)
+    if not records:
+        parser.error("no records found in %s" % args.resources)
+    if not 1 <= args.records <= RECORDS_PER_BATCH_MAX:
+        parser.error("--records must be in 1-%d range" % RECORDS_PER_BATCH_MAX)
+    batches = [records[i:i + args.records] for i in range(0, len(records), args.records)]
+    if not 2 <= len(batches) <= BATCH_COUNT_MAX:
+        parser.error("%d batches, at least 2 and at most %d are needed" % (len(batches), BATCH_COUNT_MAX))
+
+    encoding = ENCODING_RAW if args.raw else ENCODING_RUN_LENGTH
+    size = 0
+    os.makedirs(args.output, exist_ok=True)
+    for path in batch_files(args.output):
+        os.remove(path)
+    for index, batch in enumerate(batches):
+        data = b"".join(batch if args.raw else (encode_record(record) for record in batch))
+        if not args.raw and decode_records(data) != batch:
+            raise RuntimeError("run length coding mismatch in batch %d" % index)
+        size += len(data)
+        with open(os.path.join(args.output, "neural%02x.usr" % index), "wb") as f:
+            f.write(data)
+    with open(os.path.join(args.output, "dataset.usr"), "wb") as f:
+        f.write(struct.pack("<BBHBHB", HEADER_VERSION, RECORD_LENGTH, args.records, len(batches), len(records), encoding))
+
+    print("%d records in %d batches of %d, %d bytes of batch buffer needed" % (
+        len(records), len(batches), args.records, args.records * RECORD_LENGTH))
+    print("%d bytes on disk, %d%% of raw records" % (size, 100 * size // (len(records) * RECORD_LENGTH)))
+
+
+if __name__ == "__main__":
+    main()